@@ -1,32 +1,417 @@
 #include <cstring>
 #include <string>
 #include <stdexcept>
+#include <list>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <setjmp.h>
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#endif
 
 #define RAPIDXML_STATIC_POOL_SIZE (32*1024)
 #define RAPIDXML_DYNAMIC_POOL_SIZE (32*1024)
+#define RAPIDXML_NO_EXCEPTIONS
 #include <rapidxml.hpp>
 
 #include <lua.hpp>
+#include <module.h>
 
 extern "C" {
     int decode(lua_State *L);
     int encode(lua_State *L);
+    int patch(lua_State *L);
+    int compile_template(lua_State *L);
+    int compile_encoder(lua_State *L);
+    int validate(lua_State *L);
+    int get(lua_State *L);
+    int freeze(lua_State *L);
+    int unfreeze(lua_State *L);
+    int cfg(lua_State *L);
+    int cache_stats(lua_State *L);
+    int stats(lua_State *L);
+    int reset_stats(lua_State *L);
+    int new_context(lua_State *L);
     LUA_API int luaopen_luarapidxml( lua_State *L );
 }
 
 #define NAME_KEY    "tag"
 #define ATTR_KEY    "attr"
+#define RAW_KEY     "raw"
+#define NS_KEY      "ns"
+
+#define XML_NAMESPACE "http://www.w3.org/XML/1998/namespace"
 
 #define MAX_MSG_LEN 256
 #define MARK_ERROR(x,note,what) memset(x, 0, MAX_MSG_LEN); snprintf( x,MAX_MSG_LEN,"%s: %s",note,what )
 
-static char msg[MAX_MSG_LEN];
+/*
+ * The parser is built without exceptions, a parse error jumps back to
+ * parse_document() instead. Unwinding cost several times more than
+ * parsing a small document, and the parser keeps nothing to destroy
+ * on the stack.
+ */
+static jmp_buf *parse_jump;     /* set by the parse in progress */
+static const char *parse_what;
+static char *parse_where;
+
+void rapidxml::parse_error_handler(const char *what, void *where)
+{
+    parse_what = what;
+    parse_where = (char *)where;
+    longjmp(*parse_jump, 1);
+}
+
+/* parse the text, return the error or NULL, its position goes to *where */
+template<int Flags>
+static const char *parse_document(rapidxml::xml_document<> &doc, char *text,
+    const char **where = NULL)
+{
+    jmp_buf jump;
+    jmp_buf *outer = parse_jump;
+    parse_jump = &jump;
+    if (setjmp(jump) != 0) {
+        parse_jump = outer;
+        if (where)
+            *where = parse_where;
+        return parse_what;
+    }
+    doc.parse<Flags>(text);
+    parse_jump = outer;
+    return NULL;
+}
+
+/* element name given by the user, matched against names in the document */
+struct xml_name {
+    const char *str;
+    size_t len;
+};
+
+/* prefix bound by an xmlns attribute */
+struct ns_binding {
+    xml_name prefix;            /* empty for the default namespace */
+    int uri;                    /* index in the URI table, 0 if undeclared */
+};
+
+/*
+ * Frames of elements being walked without recursion. The shared stack
+ * is reused between calls, a call made while it is taken, by a fiber
+ * suspended in a yield or from a writer or a generator, gets its own.
+ */
+template<typename Frame>
+struct frame_stack {
+    frame_stack() : stack(&own)
+    {
+        if (!shared_taken) {
+            shared_taken = true;
+            stack = &shared;
+        }
+    }
+
+    ~frame_stack()
+    {
+        if (stack == &shared) {
+            shared.clear();
+            shared_taken = false;
+        }
+    }
+
+    std::vector<Frame> &get() { return *stack; }
+
+private:
+    frame_stack(const frame_stack &);
+    frame_stack &operator=(const frame_stack &);
+
+    std::vector<Frame> *stack;
+    std::vector<Frame> own;
+    static std::vector<Frame> shared;
+    static bool shared_taken;
+};
+
+template<typename Frame> std::vector<Frame> frame_stack<Frame>::shared;
+template<typename Frame> bool frame_stack<Frame>::shared_taken;
+
+/* an element with children being decoded, its table is on the Lua stack */
+struct decode_frame {
+    rapidxml::xml_node<> *node;
+    rapidxml::xml_node<> *next; /* next child to decode */
+    int depth;                  /* as in decode_open() */
+    int index;                  /* next array index in the table */
+    bool filtered;              /* children are filtered */
+    size_t scope;               /* namespace bindings to restore */
+};
+
+/* see the `yield' option */
+struct yield_state {
+    size_t every;               /* elements between yields, 0 if never */
+    size_t left;                /* elements until the next yield */
+    double *deadline;           /* timeout, not counting other fibers */
+};
+
+#ifdef WITH_STATS
+/*
+ * Counters and latency histograms of a context, see stats(). Reading
+ * the clock around each stage would cost a tenth of decoding a small
+ * document, so only one call in STATS_SAMPLE is timed.
+ */
+#define STATS_SAMPLE 16
+#define STATS_BUCKETS 24
+
+/* durations below 1, 2, 4 ... microseconds, the last bucket is unbounded */
+struct histogram {
+    uint64_t count;
+    double sum;                 /* seconds */
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+enum {
+    DECODE_ERROR_OPTIONS,       /* invalid options */
+    DECODE_ERROR_INVALID,       /* malformed document or unsupported content */
+    DECODE_ERROR_LIMIT,         /* a limit was exceeded */
+    DECODE_ERROR_CANCELLED,     /* the fiber was cancelled in a yield */
+    DECODE_ERRORS,
+};
+
+enum {
+    ENCODE_ERROR_OPTIONS,       /* invalid options */
+    ENCODE_ERROR_FAILED,        /* invalid values, writer errors, cancellation */
+    ENCODE_ERRORS,
+};
+
+struct xml_stats {
+    uint64_t decode_calls;
+    uint64_t decode_bytes;
+    uint64_t elements;          /* element tables created */
+    uint64_t attributes;
+    uint64_t strings;           /* text, attribute values and raw subtrees */
+    uint64_t decode_errors[DECODE_ERRORS];
+    uint64_t pool_blocks;       /* dynamic blocks allocated by the parser */
+    size_t pool_peak;           /* most memory the parser took for a document */
+    uint64_t encode_calls;
+    uint64_t encode_bytes;
+    uint64_t encode_errors[ENCODE_ERRORS];
+    size_t buffer_peak;         /* largest encode() buffer */
+    histogram parse;
+    histogram expand;           /* entity references in values */
+    histogram materialize;      /* building tables, without expand */
+    histogram encode;
+};
+
+/* what one decode() call produced */
+struct decode_stats {
+    bool timed;
+    double expand;              /* seconds in decode_string() */
+    uint64_t elements;
+    uint64_t attributes;
+    uint64_t strings;
+};
+
+static void histogram_add(histogram *h, double seconds)
+{
+    uint64_t us = seconds > 0 ? seconds * 1e6 : 0;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+    h->count++;
+    h->sum += seconds;
+    h->buckets[bucket]++;
+}
+
+#define STAT(x) x
+#else
+#define STAT(x)
+#endif
+
+struct decode_ctx {
+    char *msg;
+    std::vector<xml_name> raw;  /* elements returned as source slices */
+    std::vector<xml_name> skip; /* elements not decoded at any depth */
+    std::vector<std::vector<xml_name> > only; /* paths from the root to decode */
+    bool with_attributes;       /* decode attributes */
+    bool with_text;             /* decode text and CDATA */
+    const char *source;         /* the input string */
+    const char *text;           /* the parsed text, a copy of source if translated */
+    bool translated;            /* entities were expanded by the parser */
+    bool namespaces;            /* resolve element prefixes to URIs */
+    bool strip_xmlns;           /* drop namespace declarations from attributes */
+    int ns_table;               /* stack index of the URI table */
+    std::vector<ns_binding> ns_scope;  /* bindings in scope, innermost last */
+    std::vector<xml_name> ns_uris;     /* raw URIs, ns_table[i + 1] is decoded */
+    rapidxml::parse_limits limits;     /* checked by the parser */
+    double deadline;            /* thread CPU time to stop at, 0 if none */
+    size_t elements;            /* elements decoded so far */
+    const char *exceeded;       /* name of the exceeded limit, if any */
+    yield_state yield;
+    bool cancelled;             /* the fiber was cancelled in a yield */
+    frame_stack<decode_frame> frames;
+#ifdef WITH_STATS
+    decode_stats stats;
+#endif
+};
+
+/*
+ * A name without a namespace prefix also matches the local part
+ * of a prefixed one, so "Body" matches both <Body> and <soap:Body>.
+ */
+static bool name_matches(const xml_name &pattern, const char *name, size_t len)
+{
+    if (pattern.len == len)
+        return memcmp(pattern.str, name, len) == 0;
+    if (pattern.len > len)
+        return false;
+
+    const char *local = name + len - pattern.len;
+    return local[-1] == ':' &&
+        memcmp(pattern.str, local, pattern.len) == 0 &&
+        memchr(pattern.str, ':', pattern.len) == NULL;
+}
+
+static bool name_listed(const std::vector<xml_name> &list, const char *name, size_t len)
+{
+    for (size_t i = 0; i < list.size(); i++) {
+        if (name_matches(list[i], name, len))
+            return true;
+    }
+    return false;
+}
+
+/* split "a/b/@c" into names, return -1 on empty segments */
+static int split_path(const char *path, size_t len, std::vector<xml_name> &segs)
+{
+    const char *end = path + len;
+    while (path <= end) {
+        const char *sep = (const char *)memchr(path, '/', end - path);
+        if (sep == NULL)
+            sep = end;
+        if (sep == path)
+            return -1;
+        xml_name seg = {path, (size_t)(sep - path)};
+        segs.push_back(seg);
+        path = sep + 1;
+    }
+    return 0;
+}
+
+static double cpu_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define DEFAULT_YIELD_ELEMENTS 10000
+
+/* read the `yield' option, -1 if it is invalid */
+static int get_yield(lua_State *L, int idx, yield_state *yield)
+{
+    lua_getfield(L, idx, "yield");
+    int type = lua_type(L, -1);
+    double every = type == LUA_TNUMBER ? lua_tonumber(L, -1) :
+        lua_toboolean(L, -1) ? DEFAULT_YIELD_ELEMENTS : 0;
+    lua_pop(L, 1);
+    if ((type != LUA_TNIL && type != LUA_TNUMBER && type != LUA_TBOOLEAN) ||
+        (type == LUA_TNUMBER && every < 1))
+        return -1;
+    /* a yield would abort the transaction */
+    if (box_txn())
+        every = 0;
+    yield->every = every;
+    yield->left = every;
+    return 0;
+}
+
+/*
+ * Let other fibers run, the time they take is not counted against
+ * the deadline. Returns -1 if the fiber was cancelled meanwhile.
+ */
+static int yield_now(yield_state *yield)
+{
+    yield->left = yield->every;
+    double start = yield->deadline ? cpu_time() : 0;
+    /* other fibers may parse meanwhile */
+    jmp_buf *jump = parse_jump;
+    fiber_sleep(0);
+    parse_jump = jump;
+    if (yield->deadline)
+        *yield->deadline += cpu_time() - start;
+    return fiber_is_cancelled() ? -1 : 0;
+}
+
+/*
+ * Called every limits.interval parsed nodes and decoded elements to
+ * yield when it is time to and check the timeout. Returns true to stop.
+ */
+static bool decode_interrupted(void *data)
+{
+    decode_ctx *ctx = (decode_ctx *)data;
+    if (ctx->yield.every) {
+        if (ctx->yield.left > ctx->limits.interval) {
+            ctx->yield.left -= ctx->limits.interval;
+        } else if (yield_now(&ctx->yield) < 0) {
+            ctx->cancelled = true;
+            return true;
+        }
+    }
+    return ctx->deadline > 0 && cpu_time() > ctx->deadline;
+}
+
+/* read a non-negative number option, 0 if not set */
+static int get_limit(lua_State *L, int idx, const char *name, double *value)
+{
+    lua_getfield(L, idx, name);
+    int type = lua_type(L, -1);
+    *value = type == LUA_TNUMBER ? lua_tonumber(L, -1) : 0;
+    lua_pop(L, 1);
+    if ((type != LUA_TNIL && type != LUA_TNUMBER) || *value < 0)
+        return -1;
+    return 0;
+}
+
+/* read an array of strings at the top of the stack */
+static int get_name_list(lua_State *L, std::vector<xml_name> &list)
+{
+    if (lua_type(L, -1) != LUA_TTABLE)
+        return -1;
+    int n = lua_objlen(L, -1);
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, -1, i);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            lua_pop(L, 1);
+            return -1;
+        }
+        xml_name name;
+        /* the string is anchored by the options table */
+        name.str = lua_tolstring(L, -1, &name.len);
+        list.push_back(name);
+        lua_pop(L, 1);
+    }
+    return 0;
+}
 
 static int decode_string(lua_State *L, const char* str, size_t len, char* msg)
 {
     int parts = 1;
     const char* end = str+len;
 
+    /* pieces are joined as they come, so the stack never grows much */
+    if (!lua_checkstack(L, 34))
+    {
+        MARK_ERROR(msg, "xml decode", "xml decode out of stack");
+        return -1;
+    }
+
     for (const char* pos = str; pos <= end; pos++) {
         if (*pos != '&') continue;
         lua_pushlstring(L, str, pos-str);
@@ -74,6 +459,10 @@ static int decode_string(lua_State *L, const char* str, size_t len, char* msg)
         }
         str = pos+1;
         parts+=2;
+        if (parts > 32) {
+            lua_concat(L, parts - 1);
+            parts = 2;
+        }
     }
 
     lua_pushlstring(L, str, end-str);
@@ -81,289 +470,3804 @@ static int decode_string(lua_State *L, const char* str, size_t len, char* msg)
     return 0;
 }
 
-static int decode_element(lua_State *L, rapidxml::xml_node<> *node, char* msg)
+/* values without entity references, as told by the parser, are pushed as is */
+static int decode_value(lua_State *L, rapidxml::xml_base<> *base, decode_ctx *ctx)
+{
+    STAT(ctx->stats.strings++);
+    if (ctx->translated || !base->value_escaped()) {
+        lua_pushlstring(L, base->value(), base->value_size());
+        return 0;
+    }
+#ifdef WITH_STATS
+    if (ctx->stats.timed) {
+        double start = wall_time();
+        int ret = decode_string(L, base->value(), base->value_size(), ctx->msg);
+        ctx->stats.expand += wall_time() - start;
+        return ret;
+    }
+#endif
+    return decode_string(L, base->value(), base->value_size(), ctx->msg);
+}
+
+/* how an element is decoded when filters are set */
+enum {
+    FILTER_SKIP,    /* not at all */
+    FILTER_PATH,    /* leads to `only' paths: just the tag and these children */
+    FILTER_ALL,     /* in full */
+};
+
+/*
+ * Filter a child element at the given depth below the root, a negative
+ * depth means its parent is decoded in full.
+ */
+static int filter_element(rapidxml::xml_node<> *node, int depth, decode_ctx *ctx)
+{
+    if (!ctx->skip.empty() && name_listed(ctx->skip, node->name(), node->name_size()))
+        return FILTER_SKIP;
+    if (depth < 0)
+        return FILTER_ALL;
+
+    int ret = FILTER_SKIP;
+    for (size_t i = 0; i < ctx->only.size(); i++) {
+        const std::vector<xml_name> &path = ctx->only[i];
+        if (path.size() <= (size_t)depth)
+            continue;
+
+        /* compare the node and its ancestors up to the root */
+        rapidxml::xml_node<> *anc = node;
+        int seg = depth;
+        while (seg >= 0 && name_matches(path[seg], anc->name(), anc->name_size())) {
+            anc = anc->parent();
+            seg--;
+        }
+        if (seg >= 0)
+            continue;
+        if (path.size() == (size_t)depth + 1)
+            return FILTER_ALL;
+        ret = FILTER_PATH;
+    }
+    return ret;
+}
+
+static bool filter_node(rapidxml::xml_node<> *node, int depth, decode_ctx *ctx)
+{
+    if (node->type() == rapidxml::node_element)
+        return filter_element(node, depth, ctx) != FILTER_SKIP;
+    /* text of elements on the way to `only' paths is not decoded */
+    return ctx->with_text && depth < 0;
+}
+
+/* xmlns="..." or xmlns:prefix="...", the prefix is returned */
+static bool ns_declaration(rapidxml::xml_attribute<> *attr, xml_name &prefix)
+{
+    const char *name = attr->name();
+    size_t len = attr->name_size();
+    if (len < 5 || memcmp(name, "xmlns", 5) != 0)
+        return false;
+    if (len == 5) {
+        prefix.str = name + 5;
+        prefix.len = 0;
+        return true;
+    }
+    if (name[5] != ':')
+        return false;
+    prefix.str = name + 6;
+    prefix.len = len - 6;
+    return true;
+}
+
+/*
+ * Bring the namespace declarations of an element into scope. Each
+ * distinct URI is decoded once per document into the URI table, so
+ * elements share the same Lua string.
+ */
+static int ns_declare(lua_State *L, rapidxml::xml_node<> *node, decode_ctx *ctx)
+{
+    for (rapidxml::xml_attribute<> *attr = node->first_attribute(); attr;
+         attr = attr->next_attribute()) {
+        ns_binding binding;
+        if (!ns_declaration(attr, binding.prefix))
+            continue;
+
+        binding.uri = 0;
+        size_t len = attr->value_size();
+        for (size_t i = 0; len > 0 && i < ctx->ns_uris.size(); i++)
+            if (ctx->ns_uris[i].len == len &&
+                memcmp(ctx->ns_uris[i].str, attr->value(), len) == 0)
+                binding.uri = i + 1;
+        if (len > 0 && binding.uri == 0) {
+            if (decode_value(L, attr, ctx) < 0)
+                return -1;
+            xml_name uri = { attr->value(), len };
+            ctx->ns_uris.push_back(uri);
+            binding.uri = ctx->ns_uris.size();
+            lua_rawseti(L, ctx->ns_table, binding.uri);
+        }
+        ctx->ns_scope.push_back(binding);
+    }
+    return 0;
+}
+
+/* URI table index bound to the prefix, 0 if none, -1 if undeclared */
+static int ns_lookup(const char *prefix, size_t len, decode_ctx *ctx)
+{
+    for (size_t i = ctx->ns_scope.size(); i > 0; i--) {
+        const ns_binding &binding = ctx->ns_scope[i - 1];
+        if (binding.prefix.len == len && memcmp(binding.prefix.str, prefix, len) == 0)
+            return binding.uri;
+    }
+    /* unprefixed names are in no namespace unless a default is declared */
+    return len == 0 ? 0 : -1;
+}
+
+/*
+ * Tables of elements being walked are kept on the Lua stack, at most
+ * FRAME_WINDOW of them. Deeper ones are moved to a spill table at the
+ * bottom of the window and brought back as the walk returns.
+ */
+#define FRAME_WINDOW 1024
+
+/* move all but the top n tables above *spill to it, creating it if needed */
+static void frames_spill(lua_State *L, int n, int *spill, int *spilled)
+{
+    int first = lua_gettop(L) - n + 1;
+    if (!*spill) {
+        lua_newtable(L);
+        lua_insert(L, first);
+        *spill = first++;
+    }
+    for (int i = 0; i < n - 1; i++) {
+        lua_pushvalue(L, first + i);
+        lua_rawseti(L, *spill, ++*spilled);
+    }
+    lua_replace(L, first);
+    lua_settop(L, first);
+}
+
+/* bring back up to FRAME_WINDOW spilled tables below the top value */
+static int frames_restore(lua_State *L, int spill, int *spilled)
+{
+    int n = *spilled < FRAME_WINDOW ? *spilled : FRAME_WINDOW;
+    int top = lua_gettop(L);
+    luaL_checkstack(L, n + 1, "xml out of stack");
+    for (int i = *spilled - n + 1; i <= *spilled; i++)
+        lua_rawgeti(L, spill, i);
+    *spilled -= n;
+    lua_pushvalue(L, top);
+    lua_remove(L, top);
+    return n;
+}
+
+/*
+ * Start decoding the element at the given depth on the way to `only'
+ * paths, or in full if depth is negative. Returns 1 if the element has
+ * children, its frame is pushed then, 0 if its value is pushed, -1 on
+ * error.
+ */
+static int decode_open(lua_State *L, rapidxml::xml_node<> *node, int depth, decode_ctx *ctx)
 {
+    char *msg = ctx->msg;
     if (!node || rapidxml::node_element != node->type())
     {
         MARK_ERROR(msg, "decode element", "not a xml element");
         return -1;
     }
 
+    /* element source, verbatim: '<' precedes the name */
+    if (!ctx->raw.empty() && name_listed(ctx->raw, node->name(), node->name_size()))
+    {
+        const char *start = node->name() - 1;
+        lua_pushlstring(L, ctx->source + (start - ctx->text),
+            node->source_end() - start);
+        STAT(ctx->stats.strings++);
+        return 0;
+    }
+
     if ( !lua_checkstack( L,5 ) )
     {
         MARK_ERROR( msg,"decode element","xml decode out of stack" );
         return -1;
     }
 
+    if (ctx->limits.expired && ++ctx->elements % ctx->limits.interval == 0 &&
+        decode_interrupted(ctx))
+    {
+        if (ctx->cancelled) {
+            MARK_ERROR(msg, "xml decode", "fiber is cancelled");
+        } else {
+            ctx->exceeded = "timeout";
+            MARK_ERROR(msg, "xml decode: limit exceeded", ctx->exceeded);
+        }
+        return -1;
+    }
+
+    /* the local name and the namespace it resolves to */
+    const char *tag = node->name();
+    size_t tag_len = node->name_size();
+    size_t scope = ctx->ns_scope.size();
+    int ns = 0;
+    if (ctx->namespaces)
+    {
+        if (ns_declare(L, node, ctx) < 0)
+            return -1;
+        const char *colon = (const char *)memchr(tag, ':', tag_len);
+        size_t prefix_len = colon ? colon - tag : 0;
+        ns = ns_lookup(tag, prefix_len, ctx);
+        if (ns < 0)
+        {
+            std::string prefix(tag, prefix_len);
+            MARK_ERROR(msg, "xml decode: undeclared namespace prefix", prefix.c_str());
+            return -1;
+        }
+        if (colon)
+        {
+            tag_len -= prefix_len + 1;
+            tag = colon + 1;
+        }
+    }
+
+    bool filtered = depth >= 0 || !ctx->skip.empty() || !ctx->with_text;
     size_t narr = 0;
     for (rapidxml::xml_node<> *sub = node->first_node(); sub; sub = sub->next_sibling())
-        ++ narr;
-    lua_createtable(L, narr, 2 /* NAME_KEY, ATTR_KEY */);
+        if (!filtered || filter_node(sub, depth, ctx))
+            ++ narr;
+    lua_createtable(L, narr, 3 /* NAME_KEY, NS_KEY, ATTR_KEY */);
+    STAT(ctx->stats.elements++);
 
     /* element name */
     lua_pushstring( L,NAME_KEY );
-    lua_pushlstring( L,node->name(),node->name_size() );
+    lua_pushlstring( L,tag,tag_len );
     lua_rawset( L,-3 );
 
-    /* element value */
-    /* <oppn id="1" rk_min="2896" rk_max="2910"/> has no value */
-    int index = 1;
-    for (rapidxml::xml_node<> *sub = node->first_node(); sub; sub = sub->next_sibling())
+    if (ns > 0)
     {
-        if (sub->type() == rapidxml::node_element) {
-            int ret = decode_element(L, sub, msg);
-            if (ret < 0)
-                return -1;
-        } else if (sub->type()==rapidxml::node_data || sub->type()==rapidxml::node_cdata) {
-            int ret = decode_string(L, sub->value(), sub->value_size(), msg);
-            if (ret < 0)
-                return -1;
-        } else {
-            MARK_ERROR(msg, "xml decode", "unsupported xml type");
-            return -1;
-        }
-        lua_rawseti(L, -2, index);
-        ++index;
+        lua_rawgeti(L, ctx->ns_table, ns);
+        lua_setfield(L, -2, NS_KEY);
     }
 
     /* attribute */
     rapidxml::xml_attribute<> *attr = node->first_attribute();
-    if ( attr )
+    if ( attr && ctx->with_attributes && depth < 0 )
     {
         lua_pushstring(L, ATTR_KEY);
         lua_newtable(L);
+        int count = 0;
         for ( ; attr; attr = attr->next_attribute() )
         {
+            xml_name prefix;
+            if (ctx->strip_xmlns && ns_declaration(attr, prefix))
+                continue;
             lua_pushlstring(L, attr->name(), attr->name_size());
-            int ret = decode_string(L, attr->value(), attr->value_size(), msg);
+            int ret = decode_value(L, attr, ctx);
             if (ret < 0)
                 return -1;
 
             lua_rawset( L,-3 );
+            ++count;
+            STAT(ctx->stats.attributes++);
         }
-        lua_rawset( L,-3 );
+        /* no attribute table if only declarations were there */
+        if (count > 0)
+            lua_rawset( L,-3 );
+        else
+            lua_pop(L, 2);
     }
 
-    return 0;
+    /* element value */
+    /* <oppn id="1" rk_min="2896" rk_max="2910"/> has no value */
+    if (narr == 0)
+    {
+        ctx->ns_scope.resize(scope);
+        return 0;
+    }
+
+    decode_frame frame = { node, node->first_node(), depth, 1, filtered, scope };
+    ctx->frames.get().push_back(frame);
+    return 1;
 }
 
-int decode( lua_State *L )
+/*
+ * Decode the element with its subtree and push the result. Nested
+ * elements are walked with a stack of frames instead of recursion,
+ * so the depth is only limited by memory and the max_depth option.
+ */
+static int decode_element(lua_State *L, rapidxml::xml_node<> *node, int depth, decode_ctx *ctx)
 {
-    const char *str = luaL_checkstring( L,1 );
+    std::vector<decode_frame> &frames = ctx->frames.get();
+    size_t base = frames.size();
+    int spill = 0, spilled = 0;
+    int ret = decode_open(L, node, depth, ctx);
+    int tables = ret > 0;       /* frame tables on the stack */
 
-    int ret = 0;
+    while (ret >= 0 && frames.size() > base)
     {
-        rapidxml::xml_document<> doc;
-        try
-        {
-            /* never modify str */
-            doc.parse<rapidxml::parse_non_destructive>(const_cast<char*>(str));
-            ret = decode_element(L, doc.first_node(), msg);
-        }
-        catch ( const std::runtime_error& e )
-        {
-            MARK_ERROR(msg, "xml decode fail", e.what());
-            ret = -1;
-        }
-        catch (const rapidxml::parse_error& e)
-        {
-            MARK_ERROR(msg, "invalid xml string", e.what());
-            ret = -1;
-        }
-        catch (const std::exception& e)
-        {
-            MARK_ERROR(msg, "xml decode fail", e.what());
-            ret = -1;
+        decode_frame &frame = frames.back();
+        rapidxml::xml_node<> *sub = frame.next;
+        if (!sub) {
+            ctx->ns_scope.resize(frame.scope);
+            frames.pop_back();
+            /* the finished table goes to its parent */
+            if (frames.size() > base) {
+                if (tables == 1)
+                    tables += frames_restore(L, spill, &spilled);
+                lua_rawseti(L, -2, frames.back().index);
+                ++frames.back().index;
+                --tables;
+            }
+            continue;
         }
-        catch (...)
-        {
-            MARK_ERROR(msg, "xml decode fail", "unknow error");
+        frame.next = sub->next_sibling();
+
+        if (sub->type() == rapidxml::node_element) {
+            int filter = frame.filtered ? filter_element(sub, frame.depth, ctx) : FILTER_ALL;
+            if (filter == FILTER_SKIP)
+                continue;
+            ret = decode_open(L, sub, filter == FILTER_PATH ? frame.depth + 1 : -1, ctx);
+            /* a pushed frame is finished later */
+            if (ret > 0 && ++tables > FRAME_WINDOW) {
+                frames_spill(L, tables, &spill, &spilled);
+                tables = 1;
+            }
+            if (ret != 0)
+                continue;
+        } else if (frame.filtered && !filter_node(sub, frame.depth, ctx)) {
+            continue;
+        } else if (sub->type()==rapidxml::node_data || sub->type()==rapidxml::node_cdata) {
+            ret = decode_value(L, sub, ctx);
+            if (ret < 0)
+                break;
+        } else {
+            MARK_ERROR(ctx->msg, "xml decode", "unsupported xml type");
             ret = -1;
+            break;
         }
-
-        /* rapidxml static memory pool will never free,until you call clear */
-        doc.clear();
+        lua_rawseti(L, -2, frames.back().index);
+        ++frames.back().index;
     }
 
+    frames.resize(base);
     if (ret < 0)
-    {
-        lua_pushnil(L),
-        lua_pushstring(L, msg);
-        return 2;
+        return -1;
+    /* the result takes the place of the spill table */
+    if (spill)
+        lua_replace(L, spill);
+    return 0;
+}
+
+/* ==========================DECODE CACHE=================================== */
+
+/*
+ * Optional LRU cache of decoded documents. Byte-identical inputs
+ * (heartbeats, cached upstream responses) are served without
+ * running the parser. Entries are looked up by a hash of the input
+ * and confirmed with a full comparison against the retained string,
+ * so a hash collision can never return a wrong document.
+ */
+
+struct cache_entry {
+    uint64_t hash;
+    size_t cost;
+    int str_ref;    /* registry ref of the input string */
+    int lom_ref;    /* registry ref of the decoded table */
+};
+
+typedef std::list<cache_entry> cache_lru;
+
+struct decode_cache {
+    size_t capacity;    /* bytes, 0 disables the cache */
+    bool shared;        /* return cached tables as is instead of copies */
+    size_t size;
+    cache_lru lru;      /* most recently used first */
+    std::multimap<uint64_t, cache_lru::iterator> index;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+/*
+ * The retained input plus a rough allowance for the decoded tree:
+ * element tables and interned strings usually take several times
+ * the size of the markup they were built from.
+ */
+#define CACHE_COST(len) ((len) * 4 + 64)
+
+static uint64_t hash_bytes(const char *p, size_t len)
+{
+    const uint64_t m = 0xff51afd7ed558ccdULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * m);
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * m;
+        h ^= h >> 29;
     }
+    uint64_t w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w) * m;
 
-    return 1;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
-static void encode_string(struct lua_State *L, std::string &res, int idx)
+static void cache_evict(lua_State *L, decode_cache *cache, size_t capacity)
 {
-    size_t len = 0;
-    const char* str = lua_tolstring(L, idx, &len);
-    const char* end = str+len;
-
-    for (const char* pos = str; pos <= end; pos++) {
-        switch (*pos) {
-        case '<':  res.append(str, pos-str); res.append("&lt;", 4); str = pos+1; break;
-        case '>':  res.append(str, pos-str); res.append("&gt;", 4); str = pos+1; break;
-        case '&':  res.append(str, pos-str); res.append("&amp;", 5); str = pos+1; break;
-        case '"':  res.append(str, pos-str); res.append("&quot;", 6); str = pos+1; break;
-        case '\'': res.append(str, pos-str); res.append("&apos;", 6); str = pos+1; break;
+    while (cache->size > capacity && !cache->lru.empty()) {
+        cache_lru::iterator it = --cache->lru.end();
+        typedef std::multimap<uint64_t, cache_lru::iterator>::iterator idx_it;
+        std::pair<idx_it, idx_it> range = cache->index.equal_range(it->hash);
+        for (idx_it i = range.first; i != range.second; ++i) {
+            if (i->second == it) {
+                cache->index.erase(i);
+                break;
+            }
         }
+        luaL_unref(L, LUA_REGISTRYINDEX, it->str_ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, it->lom_ref);
+        cache->size -= it->cost;
+        cache->lru.erase(it);
+        cache->evictions++;
     }
-    res.append(str, end-str);
 }
 
-static int encode_element(
-    struct lua_State *L,
-    std::string &str,
-    int idx,
-    char *msg)
+static void copy_fields(lua_State *L, int from, int to)
 {
-    // soap lom object may be either a nil (it is omitted)
-    // or a string, or a number (it is converted to string by lua_tolstring())
-    // or a table:
-    // soap_lom_object = {
-    //         ["tag"] = "abc",
-    //         ["attr"] = {
-    //                 ["a1"] = "A1",
-    //                 ["a2"] = "A2",
-    //         },
-    //         [1] = "inside tag abc",
-    // },
-    // which is transformed to the string
-    // [[<abc a1="A1" a2="A2">inside tag abc</abc>]]
+    for (lua_pushnil(L); lua_next(L, from) != 0; ) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, to);
+    }
+}
+
+/* push a copy of the decoded element at idx without its children, return their number */
+static int cache_copy_element(lua_State *L, int idx)
+{
+    int narr = lua_objlen(L, idx);
+    lua_createtable(L, narr, 2 /* NAME_KEY, ATTR_KEY */);
+    int copy = lua_gettop(L);
+
+    for (lua_pushnil(L); lua_next(L, idx) != 0; ) {
+        // -1: value
+        // -2: key
+        if (lua_type(L, -2) == LUA_TNUMBER) {
+            /* children are copied by the caller */
+            lua_pop(L, 1);
+            continue;
+        }
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            /* attributes, names mapped to strings */
+            lua_newtable(L);
+            copy_fields(L, lua_gettop(L) - 1, lua_gettop(L));
+            lua_replace(L, -2);
+        }
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, copy);
+    }
+    return narr;
+}
+
+/* an element being copied, its parent waits in the table of ancestors */
+struct copy_frame {
+    int next;
+    int narr;
+};
+
+/*
+ * Push a deep copy of the decoded document at idx, sharing its strings.
+ * Elements being copied are kept in a table rather than on the C or Lua
+ * stack, so that the depth is only limited by memory.
+ */
+static void cache_copy(lua_State *L, int idx)
+{
+    luaL_checkstack(L, 8, "xml decode cache out of stack");
+    lua_newtable(L);            /* sources and copies of the ancestors */
+    int open = lua_gettop(L);
+    copy_frame root = { 1, cache_copy_element(L, idx) };
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, open + 1);
+    int src = open + 2;         /* the element being copied */
+    int dst = open + 3;
+    std::vector<copy_frame> frames(1, root);
+
+    while (!frames.empty()) {
+        copy_frame &frame = frames.back();
+        if (frame.next > frame.narr) {
+            frames.pop_back();
+            if (!frames.empty()) {
+                lua_rawgeti(L, open, 2 * frames.size() - 1);
+                lua_replace(L, src);
+                lua_rawgeti(L, open, 2 * frames.size());
+                lua_replace(L, dst);
+            }
+            continue;
+        }
+        int i = frame.next++;
+        lua_rawgeti(L, src, i);
+        if (lua_type(L, -1) != LUA_TTABLE) {
+            lua_rawseti(L, dst, i);
+            continue;
+        }
+
+        int child = lua_gettop(L);
+        copy_frame sub = { 1, cache_copy_element(L, child) };
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, dst, i);
+        /* leading text, most elements have nothing else */
+        for (; sub.next <= sub.narr; sub.next++) {
+            lua_rawgeti(L, child, sub.next);
+            if (lua_type(L, -1) == LUA_TTABLE)
+                break;
+            lua_rawseti(L, child + 1, sub.next);
+        }
+        if (sub.next > sub.narr) {
+            lua_pop(L, 2);
+            continue;
+        }
+        lua_pop(L, 1);
+        lua_pushvalue(L, src);
+        lua_rawseti(L, open, 2 * frames.size() - 1);
+        lua_pushvalue(L, dst);
+        lua_rawseti(L, open, 2 * frames.size());
+        lua_replace(L, dst);
+        lua_replace(L, src);
+        frames.push_back(sub);
+    }
+    lua_settop(L, open + 1);
+    lua_remove(L, open);
+}
+
+/* push a cached result for str, return 0 on a miss */
+static int cache_lookup(lua_State *L, decode_cache *cache, const char *str, size_t len,
+    uint64_t hash)
+{
+    typedef std::multimap<uint64_t, cache_lru::iterator>::iterator idx_it;
+    std::pair<idx_it, idx_it> range = cache->index.equal_range(hash);
+    for (idx_it i = range.first; i != range.second; ++i) {
+        cache_lru::iterator it = i->second;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, it->str_ref);
+        size_t cached_len;
+        const char *cached = lua_tolstring(L, -1, &cached_len);
+        bool same = cached_len == len &&
+            (cached == str || memcmp(cached, str, len) == 0);
+        lua_pop(L, 1);
+        if (!same)
+            continue;
+
+        cache->lru.splice(cache->lru.begin(), cache->lru, it);
+        cache->hits++;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, it->lom_ref);
+        if (!cache->shared) {
+            cache_copy(L, lua_gettop(L));
+            lua_remove(L, -2);
+        }
+        return 1;
+    }
+    cache->misses++;
+    return 0;
+}
+
+/* remember the table on top of the stack as the result for str at idx */
+static void cache_store(lua_State *L, decode_cache *cache, int str_idx, size_t len,
+    uint64_t hash)
+{
+    size_t cost = CACHE_COST(len);
+    if (cost > cache->capacity)
+        return;
+    cache_evict(L, cache, cache->capacity - cost);
+
+    cache_entry e;
+    e.hash = hash;
+    e.cost = cost;
+    lua_pushvalue(L, str_idx);
+    e.str_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (cache->shared) {
+        lua_pushvalue(L, -1);
+    } else {
+        /* the caller owns the returned table, keep a private copy */
+        cache_copy(L, lua_gettop(L));
+    }
+    e.lom_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    cache->lru.push_front(e);
+    cache->index.insert(std::make_pair(hash, cache->lru.begin()));
+    cache->size += cost;
+}
+
+/* =============================CONTEXTS==================================== */
+
+#define DEFAULT_ENCODE_BUFFER_SIZE (1024*1024)
+
+/*
+ * Buffers, the decode cache and default options. The module functions
+ * use the default context, new() creates independent ones, so that
+ * workloads neither evict each other's cached documents nor share
+ * settings. Every function gets its context as the first upvalue.
+ */
+struct xml_context {
+    char msg[MAX_MSG_LEN];      /* the last error */
+    std::string res;            /* output of encode(), kept between calls */
+    bool res_taken;             /* res is used by a call in progress */
+    size_t res_retain;          /* capacity res may keep between calls */
+    decode_cache cache;
+    int decode_options;         /* registry refs of default options */
+    int encode_options;
+#ifdef WITH_STATS
+    xml_stats stats;
+#endif
+
+    xml_context()
+        : res_taken(false)
+        , res_retain(DEFAULT_ENCODE_BUFFER_SIZE)
+        , decode_options(LUA_NOREF)
+        , encode_options(LUA_NOREF)
+    {
+        msg[0] = '\0';
+        cache.capacity = 0;
+        cache.shared = false;
+        cache.size = 0;
+        cache.hits = 0;
+        cache.misses = 0;
+        cache.evictions = 0;
+#ifdef WITH_STATS
+        memset(&stats, 0, sizeof(stats));
+#endif
+    }
+};
+
+static xml_context default_context;
+
+static xml_context *get_context(lua_State *L)
+{
+    return (xml_context *)lua_touserdata(L, lua_upvalueindex(1));
+}
+
+/* keep the context of the called function alive, for objects it creates */
+static int context_ref(lua_State *L)
+{
+    if (lua_type(L, lua_upvalueindex(1)) != LUA_TUSERDATA)
+        return LUA_NOREF;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/* release the output buffer after a large document */
+static void res_shrink(xml_context *context)
+{
+    if (context->res.capacity() > context->res_retain)
+        std::string().swap(context->res);
+}
+
+/*
+ * The output buffer of the context, reused between calls. A call made
+ * while it is taken, by a fiber suspended in a yield or from a
+ * generator, a writer or a metamethod, gets its own.
+ */
+struct output_buffer {
+    explicit output_buffer(xml_context *context) : context(context), str(&own)
+    {
+        if (!context->res_taken) {
+            context->res_taken = true;
+            str = &context->res;
+        }
+        str->clear();
+    }
+
+    ~output_buffer()
+    {
+        if (str == &context->res) {
+            res_shrink(context);
+            context->res_taken = false;
+        }
+    }
+
+    std::string &get() { return *str; }
+
+private:
+    output_buffer(const output_buffer &);
+    output_buffer &operator=(const output_buffer &);
+
+    xml_context *context;
+    std::string *str;
+    std::string own;
+};
+
+/* replace the options at idx with the defaults they override */
+static void context_options(lua_State *L, int idx, int defaults)
+{
+    lua_settop(L, idx);
+    if (!lua_isnil(L, idx) && !lua_istable(L, idx))
+        return;     /* reported by the caller */
+    lua_newtable(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, defaults);
+    copy_fields(L, idx + 2, idx + 1);
+    lua_pop(L, 1);
+    if (!lua_isnil(L, idx))
+        copy_fields(L, idx, idx + 1);
+    lua_replace(L, idx);
+}
+
+/* ================================PROBES=================================== */
+
+/*
+ * USDT probes for bpftrace, perf and SystemTap. A probe is a nop until
+ * a tracer attaches to it and sets its semaphore, durations and node
+ * counts are only measured then:
+ *
+ *   decode__start(size)
+ *   decode__parsed(size, nodes, ns)    the parser succeeded
+ *   decode__done(size, nodes, ns)      nodes is 0 for a cached document
+ *   decode__error(size, message, ns)
+ *   encode__start()
+ *   encode__done(bytes, ns)
+ *   encode__error(message, ns)
+ *
+ * Calls with invalid options fire none of them.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define PROBE_SEMAPHORE(name) \
+    unsigned short luarapidxml_##name##_semaphore __attribute__((section(".probes")))
+#define PROBE_ENABLED(name) __builtin_expect(luarapidxml_##name##_semaphore != 0, 0)
+#define PROBE0(name) STAP_PROBE(luarapidxml, name)
+#define PROBE1(name, a) STAP_PROBE1(luarapidxml, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(luarapidxml, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(luarapidxml, name, a, b, c)
+
+PROBE_SEMAPHORE(decode__start);
+PROBE_SEMAPHORE(decode__parsed);
+PROBE_SEMAPHORE(decode__done);
+PROBE_SEMAPHORE(decode__error);
+PROBE_SEMAPHORE(encode__start);
+PROBE_SEMAPHORE(encode__done);
+PROBE_SEMAPHORE(encode__error);
+#else
+/* the arguments are not evaluated */
+#define PROBE_ENABLED(name) false
+#define PROBE0(name) ((void)0)
+#define PROBE1(name, a) ((void)sizeof(a))
+#define PROBE2(name, a, b) ((void)sizeof((a), (b)))
+#define PROBE3(name, a, b, c) ((void)sizeof((a), (b), (c)))
+#endif
+
+#define DECODE_TRACED (PROBE_ENABLED(decode__start) || PROBE_ENABLED(decode__parsed) || \
+    PROBE_ENABLED(decode__done) || PROBE_ENABLED(decode__error))
+#define ENCODE_TRACED (PROBE_ENABLED(encode__start) || PROBE_ENABLED(encode__done) || \
+    PROBE_ENABLED(encode__error))
+
+/* nanoseconds since start, 0 if the call is not traced */
+static uint64_t probe_ns(double start)
+{
+    return start > 0 ? (wall_time() - start) * 1e9 : 0;
+}
+
+/* decode options mapped onto rapidxml parse flags */
+enum {
+    DECODE_TRIM = 1,        /* trim_whitespace */
+    DECODE_NORMALIZE = 2,   /* normalize_whitespace, implies DECODE_TRANSLATE */
+    DECODE_VALIDATE = 4,    /* validate_closing_tags */
+    DECODE_TRANSLATE = 8,   /* translate_entities, parses a copy of the input */
+};
+
+static const struct {
+    const char *name;
+    int flag;
+} decode_flags[] = {
+    {"trim_whitespace", DECODE_TRIM},
+    {"normalize_whitespace", DECODE_NORMALIZE},
+    {"validate_closing_tags", DECODE_VALIDATE},
+    {"translate_entities", DECODE_TRANSLATE},
+};
+
+typedef const char *(*decode_parser)(rapidxml::xml_document<> &doc, char *text);
+
+template<int Flags>
+static const char *parse_flags(rapidxml::xml_document<> &doc, char *text)
+{
+    return parse_document<Flags>(doc, text);
+}
+
+#define PARSE_ND rapidxml::parse_non_destructive
+#define PARSE_T rapidxml::parse_trim_whitespace
+#define PARSE_N rapidxml::parse_normalize_whitespace
+#define PARSE_V rapidxml::parse_validate_closing_tags
+
+/* indexed by DECODE_* flags */
+static const decode_parser decode_parsers[16] = {
+    parse_flags<PARSE_ND>,
+    parse_flags<PARSE_ND | PARSE_T>,
+    NULL,
+    NULL,
+    parse_flags<PARSE_ND | PARSE_V>,
+    parse_flags<PARSE_ND | PARSE_V | PARSE_T>,
+    NULL,
+    NULL,
+    parse_flags<0>,
+    parse_flags<PARSE_T>,
+    parse_flags<PARSE_N>,
+    parse_flags<PARSE_N | PARSE_T>,
+    parse_flags<PARSE_V>,
+    parse_flags<PARSE_V | PARSE_T>,
+    parse_flags<PARSE_V | PARSE_N>,
+    parse_flags<PARSE_V | PARSE_N | PARSE_T>,
+};
+
+int decode( lua_State *L )
+{
+    size_t len = 0;
+    const char *str = luaL_checklstring( L,1,&len );
+    xml_context *context = get_context(L);
+    char *msg = context->msg;
+    /* the defaults of a context never change, they don't affect caching */
+    bool plain = lua_isnoneornil(L, 2);
+    if (context->decode_options != LUA_NOREF)
+        context_options(L, 2, context->decode_options);
+#ifdef WITH_STATS
+    xml_stats *stats = &context->stats;
+    bool timed = stats->decode_calls++ % STATS_SAMPLE == 0;
+    stats->decode_bytes += len;
+#endif
+
+    decode_ctx ctx;
+    ctx.msg = msg;
+    ctx.source = str;
+    ctx.text = str;
+    ctx.translated = false;
+    ctx.with_attributes = true;
+    ctx.with_text = true;
+    ctx.namespaces = false;
+    ctx.strip_xmlns = false;
+    ctx.ns_table = 0;
+    memset(&ctx.limits, 0, sizeof(ctx.limits));
+    ctx.deadline = 0;
+    ctx.elements = 0;
+    ctx.exceeded = NULL;
+    memset(&ctx.yield, 0, sizeof(ctx.yield));
+    ctx.cancelled = false;
+#ifdef WITH_STATS
+    memset(&ctx.stats, 0, sizeof(ctx.stats));
+#endif
+    double max_bytes = 0;
+    double timeout = 0;
+    int flags = 0;
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        if (lua_type(L, 2) != LUA_TTABLE)
+        {
+            MARK_ERROR(msg, "xml decode", "options must be a table");
+            STAT(stats->decode_errors[DECODE_ERROR_OPTIONS]++);
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+
+        lua_getfield(L, 2, "raw");
+        int ret = lua_isnil(L, -1) ? 0 : get_name_list(L, ctx.raw);
+        lua_pop(L, 1);
+        if (ret < 0)
+        {
+            MARK_ERROR(msg, "xml decode", "`raw' option must be an array of strings");
+            STAT(stats->decode_errors[DECODE_ERROR_OPTIONS]++);
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+
+        lua_getfield(L, 2, "skip");
+        ret = lua_isnil(L, -1) ? 0 : get_name_list(L, ctx.skip);
+        lua_pop(L, 1);
+        if (ret < 0)
+        {
+            MARK_ERROR(msg, "xml decode", "`skip' option must be an array of strings");
+            STAT(stats->decode_errors[DECODE_ERROR_OPTIONS]++);
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+
+        std::vector<xml_name> only;
+        lua_getfield(L, 2, "only");
+        ret = lua_isnil(L, -1) ? 0 : get_name_list(L, only);
+        lua_pop(L, 1);
+        for (size_t i = 0; ret == 0 && i < only.size(); i++)
+        {
+            ctx.only.push_back(std::vector<xml_name>());
+            ret = split_path(only[i].str, only[i].len, ctx.only.back());
+        }
+        if (ret < 0)
+        {
+            MARK_ERROR(msg, "xml decode", "`only' option must be an array of paths");
+            STAT(stats->decode_errors[DECODE_ERROR_OPTIONS]++);
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+
+        lua_getfield(L, 2, "attributes");
+        ctx.with_attributes = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "text");
+        ctx.with_text = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "namespaces");
+        ctx.namespaces = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "strip_xmlns");
+        ctx.strip_xmlns = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        static const char *limit_names[] = {
+            "max_bytes", "max_depth", "max_nodes", "max_attributes",
+            "max_string", "timeout",
+        };
+        double limit[sizeof(limit_names) / sizeof(limit_names[0])];
+        for (size_t i = 0; i < sizeof(limit_names) / sizeof(limit_names[0]); i++)
+        {
+            if (get_limit(L, 2, limit_names[i], &limit[i]) < 0)
+            {
+                std::string what = std::string("`") + limit_names[i] +
+                    "' option must be a non-negative number";
+                MARK_ERROR(msg, "xml decode", what.c_str());
+                STAT(stats->decode_errors[DECODE_ERROR_OPTIONS]++);
+                lua_pushnil(L);
+                lua_pushstring(L, msg);
+                return 2;
+            }
+        }
+        max_bytes = limit[0];
+        ctx.limits.max_depth = limit[1];
+        ctx.limits.max_nodes = limit[2];
+        ctx.limits.max_attributes = limit[3];
+        ctx.limits.max_string = limit[4];
+        timeout = limit[5];
+
+        if (get_yield(L, 2, &ctx.yield) < 0)
+        {
+            MARK_ERROR(msg, "xml decode", "`yield' option must be a boolean or a positive number");
+            STAT(stats->decode_errors[DECODE_ERROR_OPTIONS]++);
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+
+        for (size_t i = 0; i < sizeof(decode_flags) / sizeof(decode_flags[0]); i++)
+        {
+            lua_getfield(L, 2, decode_flags[i].name);
+            if (lua_toboolean(L, -1))
+                flags |= decode_flags[i].flag;
+            lua_pop(L, 1);
+        }
+        /* whitespace can only be normalized in a writable copy */
+        if (flags & DECODE_NORMALIZE)
+            flags |= DECODE_TRANSLATE;
+    }
+
+    double trace_start = DECODE_TRACED ? wall_time() : 0;
+    PROBE1(decode__start, len);
+
+    /* options change the result, so only plain calls are cached */
+    decode_cache *cache = &context->cache;
+    bool cacheable = cache->capacity > 0 && plain;
+    uint64_t hash = 0;
+    if (cacheable) {
+        hash = hash_bytes(str, len);
+        if (cache_lookup(L, cache, str, len, hash)) {
+            PROBE3(decode__done, len, 0, probe_ns(trace_start));
+            return 1;
+        }
+    }
+
+    if (max_bytes > 0 && len > max_bytes)
+    {
+        MARK_ERROR(msg, "xml decode: limit exceeded", "max_bytes");
+        STAT(stats->decode_errors[DECODE_ERROR_LIMIT]++);
+        PROBE3(decode__error, len, msg, probe_ns(trace_start));
+        lua_pushnil(L);
+        lua_pushstring(L, msg);
+        lua_pushstring(L, "max_bytes");
+        return 3;
+    }
+    if (timeout > 0)
+    {
+        ctx.deadline = cpu_time() + timeout;
+        ctx.yield.deadline = &ctx.deadline;
+    }
+    if (timeout > 0 || ctx.yield.every)
+    {
+        ctx.limits.expired = decode_interrupted;
+        ctx.limits.data = &ctx;
+        ctx.limits.interval = ctx.yield.every && ctx.yield.every < 1024 ?
+            ctx.yield.every : 1024;
+    }
+
+    /* URIs of the document, the xml prefix is bound by definition */
+    if (ctx.namespaces) {
+        lua_createtable(L, 1, 0);
+        lua_pushliteral(L, XML_NAMESPACE);
+        lua_rawseti(L, -2, 1);
+        ctx.ns_table = lua_gettop(L);
+        xml_name uri = { XML_NAMESPACE, sizeof(XML_NAMESPACE) - 1 };
+        ns_binding binding = { { "xml", 3 }, 1 };
+        ctx.ns_uris.push_back(uri);
+        ctx.ns_scope.push_back(binding);
+    }
+
+    int ret = 0;
+    {
+        rapidxml::xml_document<> doc;
+        try
+        {
+            /* never modify str, the copy lives in the document pool */
+            char *text = const_cast<char*>(str);
+            if (flags & DECODE_TRANSLATE) {
+                text = doc.allocate_string(str, len + 1);
+                ctx.text = text;
+                ctx.translated = true;
+            }
+            /* unlimited documents are parsed without the checks, traced ones count nodes */
+            if (ctx.limits.max_depth || ctx.limits.max_nodes || ctx.limits.max_attributes ||
+                ctx.limits.max_string || ctx.limits.expired || trace_start > 0)
+                doc.limits(&ctx.limits);
+#ifdef WITH_STATS
+            double start = timed ? wall_time() : 0;
+#endif
+            const char *error = decode_parsers[flags](doc, text);
+            if (error == NULL) {
+                PROBE3(decode__parsed, len, ctx.limits.nodes, probe_ns(trace_start));
+#ifdef WITH_STATS
+                double parsed = timed ? wall_time() : 0;
+                ctx.stats.timed = timed;
+#endif
+                ret = decode_element(L, doc.first_node(), ctx.only.empty() ? -1 : 0, &ctx);
+#ifdef WITH_STATS
+                if (timed && ret == 0) {
+                    histogram_add(&stats->parse, parsed - start);
+                    histogram_add(&stats->expand, ctx.stats.expand);
+                    histogram_add(&stats->materialize,
+                        wall_time() - parsed - ctx.stats.expand);
+                }
+#endif
+            } else if (ctx.cancelled) {
+                MARK_ERROR(msg, "xml decode", "fiber is cancelled");
+                ret = -1;
+            } else if (ctx.limits.exceeded) {
+                ctx.exceeded = ctx.limits.exceeded;
+                MARK_ERROR(msg, "xml decode: limit exceeded", ctx.exceeded);
+                ret = -1;
+            } else {
+                MARK_ERROR(msg, "invalid xml string", error);
+                ret = -1;
+            }
+        }
+        catch ( const std::runtime_error& e )
+        {
+            MARK_ERROR(msg, "xml decode fail", e.what());
+            ret = -1;
+        }
+        catch (const std::exception& e)
+        {
+            MARK_ERROR(msg, "xml decode fail", e.what());
+            ret = -1;
+        }
+        catch (...)
+        {
+            MARK_ERROR(msg, "xml decode fail", "unknow error");
+            ret = -1;
+        }
+
+#ifdef WITH_STATS
+        stats->pool_blocks += doc.dynamic_blocks();
+        if (doc.allocated() > stats->pool_peak)
+            stats->pool_peak = doc.allocated();
+        stats->elements += ctx.stats.elements;
+        stats->attributes += ctx.stats.attributes;
+        stats->strings += ctx.stats.strings;
+#endif
+        /* rapidxml static memory pool will never free,until you call clear */
+        doc.clear();
+    }
+
+    /* the exceeded limit is returned too, to tell it from invalid input */
+    if (ret < 0 && ctx.exceeded)
+    {
+        STAT(stats->decode_errors[DECODE_ERROR_LIMIT]++);
+        PROBE3(decode__error, len, msg, probe_ns(trace_start));
+        lua_pushnil(L);
+        lua_pushstring(L, msg);
+        lua_pushstring(L, ctx.exceeded);
+        return 3;
+    }
+    if (ret < 0)
+    {
+        STAT(stats->decode_errors[ctx.cancelled ?
+            DECODE_ERROR_CANCELLED : DECODE_ERROR_INVALID]++);
+        PROBE3(decode__error, len, msg, probe_ns(trace_start));
+        lua_pushnil(L),
+        lua_pushstring(L, msg);
+        return 2;
+    }
+
+    if (cacheable)
+        cache_store(L, cache, 1, len, hash);
+
+    PROBE3(decode__done, len, ctx.limits.nodes, probe_ns(trace_start));
+    return 1;
+}
+
+static void escape_string(std::string &res, const char *str, size_t len)
+{
+    const char* end = str+len;
+
+    for (const char* pos = str; pos < end; pos++) {
+        switch (*pos) {
+        case '<':  res.append(str, pos-str); res.append("&lt;", 4); str = pos+1; break;
+        case '>':  res.append(str, pos-str); res.append("&gt;", 4); str = pos+1; break;
+        case '&':  res.append(str, pos-str); res.append("&amp;", 5); str = pos+1; break;
+        case '"':  res.append(str, pos-str); res.append("&quot;", 6); str = pos+1; break;
+        case '\'': res.append(str, pos-str); res.append("&apos;", 6); str = pos+1; break;
+        }
+    }
+    res.append(str, end-str);
+}
+
+
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static void format_integer(std::string &str, uint64_t num, bool neg)
+{
+    char buf[24];
+    char *pos = buf + sizeof(buf);
+    while (num >= 100) {
+        const char *pair = digit_pairs + (num % 100) * 2;
+        num /= 100;
+        *--pos = pair[1];
+        *--pos = pair[0];
+    }
+    if (num >= 10) {
+        const char *pair = digit_pairs + num * 2;
+        *--pos = pair[1];
+        *--pos = pair[0];
+    } else {
+        *--pos = '0' + num;
+    }
+    if (neg)
+        *--pos = '-';
+    str.append(pos, buf + sizeof(buf) - pos);
+}
+
+static const double pow10_table[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6};
+
+/* same output as tostring(), without creating a Lua string */
+static void format_number(std::string &str, double num)
+{
+    /* below 1e14 "%.14g" prints integers in full */
+    if (num > -1e14 && num < 1e14 && num == (double)(int64_t)num &&
+        !(num == 0 && signbit(num))) {
+        int64_t i = num;
+        format_integer(str, i < 0 ? -(uint64_t)i : i, i < 0);
+        return;
+    }
+
+    /* short fractions like prices, "%.14g" keeps all their digits */
+    double abs = fabs(num);
+    if (abs >= 1e-4 && abs < 1e13) {
+        for (int k = 1; k <= 6; k++) {
+            double scaled = abs * pow10_table[k];
+            if (scaled >= 1e14)
+                break;
+            if (scaled != (double)(uint64_t)scaled)
+                continue;
+
+            uint64_t digits = scaled;
+            uint64_t div = pow10_table[k];
+            format_integer(str, digits / div, num < 0);
+            uint64_t frac = digits % div;
+            char buf[8];
+            for (int i = k - 1; i >= 0; i--) {
+                buf[i] = '0' + frac % 10;
+                frac /= 10;
+            }
+            while (k > 0 && buf[k - 1] == '0')
+                k--;
+            str.push_back('.');
+            str.append(buf, k);
+            return;
+        }
+    }
+
+    /* LuaJIT spells these itself, glibc would print "-nan" */
+    if (num != num) {
+        str.append("nan", 3);
+        return;
+    }
+    if (isinf(num)) {
+        if (num < 0)
+            str.push_back('-');
+        str.append("inf", 3);
+        return;
+    }
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), LUA_NUMBER_FMT, num);
+    str.append(buf, len);
+}
+
+#ifndef LUA_TCDATA
+#define LUA_TCDATA 10
+#endif
+
+static uint32_t CTID_INT64;
+static uint32_t CTID_UINT64;
+
+/*
+ * Append a string (escaped), a number, a boolean or an int64_t/uint64_t
+ * cdata. Returns false for other values.
+ */
+static bool encode_scalar(lua_State *L, std::string &str, int idx)
+{
+    switch (lua_type(L, idx)) {
+    case LUA_TSTRING:
+    {
+        size_t len;
+        const char *val = lua_tolstring(L, idx, &len);
+        escape_string(str, val, len);
+        return true;
+    }
+    case LUA_TNUMBER:
+        format_number(str, lua_tonumber(L, idx));
+        return true;
+    case LUA_TBOOLEAN:
+        if (lua_toboolean(L, idx))
+            str.append("true", 4);
+        else
+            str.append("false", 5);
+        return true;
+    case LUA_TCDATA:
+    {
+        uint32_t ctypeid;
+        void *data = luaL_checkcdata(L, idx, &ctypeid);
+        if (ctypeid == CTID_INT64) {
+            int64_t i = *(int64_t *)data;
+            format_integer(str, i < 0 ? -(uint64_t)i : i, i < 0);
+            return true;
+        }
+        if (ctypeid == CTID_UINT64) {
+            format_integer(str, *(uint64_t *)data, false);
+            return true;
+        }
+        return false;
+    }
+    default:
+        return false;
+    }
+}
+
+static bool needs_escaping(const char *str, size_t len)
+{
+    for (const char *end = str + len; str < end; str++) {
+        switch (*str) {
+        case '<': case '>': case '&': case '"': case '\'':
+            return true;
+        }
+    }
+    return false;
+}
+
+#define NO_CAPTURE ((size_t)-1)
+
+/* an element with children being encoded */
+struct encode_frame {
+    int idx;            /* stack index of the element table */
+    int next;           /* next child to encode */
+    int objlen;
+    const char *tag;    /* kept alive by the table */
+    size_t tag_len;
+    size_t capture;     /* output offset of a frozen element, or NO_CAPTURE */
+};
+
+struct encode_ctx {
+    char *msg;
+    bool validate_raw;  /* check raw fragments are well-formed */
+    bool stream;        /* output goes to the writer or the ibuf */
+    int writer;         /* stack index of the writer function, 0 if none */
+    int writer_self;    /* stack index of the writer object, 0 if none */
+#ifdef HAVE_BOX_IBUF
+    box_ibuf_t *ibuf;   /* output is appended here if set */
+#endif
+    size_t chunk_size;  /* output is passed to the writer in such chunks */
+    size_t written;
+    int frozen;         /* stack index of the frozen tables registry, 0 if none */
+    int capture;        /* > 0 while a frozen subtree is being serialized */
+    yield_state yield;
+    frame_stack<encode_frame> frames;
+};
+
+#define DEFAULT_CHUNK_SIZE (64*1024)
+
+static void encode_ctx_init(encode_ctx *ctx, char *msg)
+{
+    ctx->msg = msg;
+    ctx->validate_raw = false;
+    ctx->stream = false;
+    ctx->writer = 0;
+    ctx->writer_self = 0;
+#ifdef HAVE_BOX_IBUF
+    ctx->ibuf = NULL;
+#endif
+    ctx->chunk_size = DEFAULT_CHUNK_SIZE;
+    ctx->written = 0;
+    ctx->frozen = 0;
+    ctx->capture = 0;
+    memset(&ctx->yield, 0, sizeof(ctx->yield));
+}
+
+/* output can't be flushed while a frozen subtree is being captured */
+static bool encode_streaming(const encode_ctx *ctx)
+{
+    return ctx->stream && ctx->capture == 0;
+}
+
+/* take the ibuf at idx as the output */
+static int encode_set_ibuf(lua_State *L, int idx, encode_ctx *ctx)
+{
+#ifdef HAVE_BOX_IBUF
+    ctx->ibuf = luaT_toibuf(L, idx);
+    if (ctx->ibuf == NULL)
+    {
+        MARK_ERROR(ctx->msg, "xml encode", "`ibuf' must be a buffer.ibuf() object");
+        return -1;
+    }
+    if (ctx->writer)
+    {
+        MARK_ERROR(ctx->msg, "xml encode", "`ibuf' and `writer' can't be used together");
+        return -1;
+    }
+    ctx->stream = true;
+    return 0;
+#else
+    (void)L;
+    (void)idx;
+    MARK_ERROR(ctx->msg, "xml encode", "`ibuf' is not supported by this Tarantool version");
+    return -1;
+#endif
+}
+
+#ifdef HAVE_BOX_IBUF
+static int ibuf_append(encode_ctx *ctx, const char *data, size_t len)
+{
+    char *dst = (char *)box_ibuf_reserve(ctx->ibuf, len);
+    if (dst == NULL)
+    {
+        MARK_ERROR(ctx->msg, "xml encode", "failed to allocate ibuf memory");
+        return -1;
+    }
+    memcpy(dst, data, len);
+
+    char **wpos;
+    box_ibuf_write_range(ctx->ibuf, &wpos, NULL);
+    *wpos += len;
+    ctx->written += len;
+    return 0;
+}
+#endif
+
+/* pass the string at idx to the writer */
+static int encode_write(lua_State *L, int idx, encode_ctx *ctx)
+{
+    char *msg = ctx->msg;
+#ifdef HAVE_BOX_IBUF
+    if (ctx->ibuf)
+    {
+        size_t len;
+        const char *data = lua_tolstring(L, idx, &len);
+        return ibuf_append(ctx, data, len);
+    }
+#endif
+    if (!lua_checkstack(L, 4))
+    {
+        MARK_ERROR(msg, "encode element", "xml encode out of stack");
+        return -1;
+    }
+
+    size_t len = lua_objlen(L, idx);
+    int top = lua_gettop(L);
+    lua_pushvalue(L, ctx->writer);
+    if (ctx->writer_self)
+        lua_pushvalue(L, ctx->writer_self);
+    lua_pushvalue(L, idx);
+    if (lua_pcall(L, ctx->writer_self ? 2 : 1, 2, 0) != 0)
+    {
+        const char *err = lua_tostring(L, -1);
+        MARK_ERROR(msg, "xml encode: writer failed", err ? err : "unknown error");
+        lua_settop(L, top);
+        return -1;
+    }
+
+    /* socket and fio objects report failures with nil or false */
+    if (ctx->writer_self && !lua_toboolean(L, -2))
+    {
+        const char *err = lua_isstring(L, -1) ? lua_tostring(L, -1) : "write failed";
+        MARK_ERROR(msg, "xml encode: writer failed", err);
+        lua_settop(L, top);
+        return -1;
+    }
+    lua_settop(L, top);
+    ctx->written += len;
+    return 0;
+}
+
+/* pass buffered output to the writer */
+static int encode_flush(lua_State *L, std::string &str, encode_ctx *ctx)
+{
+    if (str.empty())
+        return 0;
+#ifdef HAVE_BOX_IBUF
+    if (ctx->ibuf)
+    {
+        int ret = ibuf_append(ctx, str.data(), str.size());
+        str.clear();
+        return ret;
+    }
+#endif
+    lua_pushlstring(L, str.data(), str.size());
+    int ret = encode_write(L, lua_gettop(L), ctx);
+    lua_pop(L, 1);
+    str.clear();
+    return ret;
+}
+
+static int encode_text(lua_State *L, std::string &str, int idx, encode_ctx *ctx)
+{
+    size_t len = 0;
+    const char* text = lua_tolstring(L, idx, &len);
+    if (!encode_streaming(ctx))
+    {
+        escape_string(str, text, len);
+        return 0;
+    }
+
+    /* large values needing no escaping are handed over as is */
+    if (len >= ctx->chunk_size / 2 && !needs_escaping(text, len))
+    {
+        if (encode_flush(L, str, ctx) < 0)
+            return -1;
+        return encode_write(L, idx, ctx);
+    }
+
+    /* escape the rest piecewise to keep the buffer bounded */
+    while (len > 0)
+    {
+        size_t n = len < ctx->chunk_size ? len : ctx->chunk_size;
+        escape_string(str, text, n);
+        text += n;
+        len -= n;
+        if (str.size() >= ctx->chunk_size && encode_flush(L, str, ctx) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static const char *check_tree_entities(rapidxml::xml_node<> *root, const char **what);
+
+/*
+ * Check that a pre-serialized fragment is well-formed: matching closing
+ * tags and valid entity references. Several sibling elements are fine.
+ */
+static int validate_fragment(const char *str, size_t len, char *msg)
+{
+    /* the parser stops at '\0', the rest would go out unchecked */
+    if (strlen(str) != len)
+    {
+        MARK_ERROR(msg, "encode element: invalid raw fragment",
+                   "unexpected zero byte");
+        return -1;
+    }
+
+    int ret = 0;
+    rapidxml::xml_document<> doc;
+    try
+    {
+        /* never modify str, data nodes are enough to check values */
+        const int flags = PARSE_ND | rapidxml::parse_no_element_values | PARSE_V;
+        const char *error = parse_document<flags>(doc, const_cast<char*>(str));
+        for (rapidxml::xml_node<> *node = doc.first_node();
+             node && !error; node = node->next_sibling())
+        {
+            const char *what = NULL;
+            if (check_tree_entities(node, &what))
+                error = what;
+        }
+        if (error)
+        {
+            MARK_ERROR(msg, "encode element: invalid raw fragment", error);
+            ret = -1;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        MARK_ERROR(msg, "encode element: invalid raw fragment", e.what());
+        ret = -1;
+    }
+    doc.clear();
+    return ret;
+}
+
+static int encode_content(lua_State *L, std::string &str, int idx, encode_ctx *ctx);
+
+/* luafun iterators, e.g. box.space.x:pairs():map(...), or callables */
+static bool is_generator(lua_State *L, int idx)
+{
+    /* every cdata is callable from the metatable point of view */
+    if (!lua_istable(L, idx) && lua_type(L, idx) != LUA_TUSERDATA)
+        return false;
+    if (luaL_getmetafield(L, idx, "__call")) {
+        lua_pop(L, 1);
+        return true;
+    }
+    if (!lua_istable(L, idx))
+        return false;
+    lua_getfield(L, idx, "gen");
+    bool gen = lua_isfunction(L, -1);
+    lua_pop(L, 1);
+    return gen;
+}
+
+/* pull children from the generator at idx until it is exhausted */
+static int encode_generator(lua_State *L, std::string &str, int idx, encode_ctx *ctx)
+{
+    char *msg = ctx->msg;
+    int top = lua_gettop(L);
+    int gen = idx;
+    int state = 0;
+
+    if (lua_istable(L, idx)) {
+        /* gen(param, state) returns the next state and the value */
+        lua_getfield(L, idx, "gen");
+        if (lua_isfunction(L, -1)) {
+            lua_getfield(L, idx, "param");
+            lua_getfield(L, idx, "state");
+            gen = top + 1;
+            state = top + 3;
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    for (;;) {
+        if (!lua_checkstack(L, 5))
+        {
+            MARK_ERROR(msg, "encode element", "xml encode out of stack");
+            return -1;
+        }
+
+        lua_pushvalue(L, gen);
+        if (state) {
+            lua_pushvalue(L, state - 1);
+            lua_pushvalue(L, state);
+        }
+        if (lua_pcall(L, state ? 2 : 0, 2, 0) != 0)
+        {
+            const char *err = lua_tostring(L, -1);
+            MARK_ERROR(msg, "xml encode: generator failed", err ? err : "unknown error");
+            lua_settop(L, top);
+            return -1;
+        }
+
+        if (state) {
+            // -1: value
+            // -2: next state
+            if (lua_isnil(L, -2))
+                break;
+            lua_pushvalue(L, -2);
+            lua_replace(L, state);
+        } else {
+            // -1: second result
+            // -2: value
+            lua_pop(L, 1);
+            if (lua_isnil(L, -1))
+                break;
+        }
+
+        if (encode_content(L, str, lua_gettop(L), ctx) < 0)
+            return -1;
+        lua_settop(L, state ? state : top);
+
+        if (encode_streaming(ctx) && str.size() >= ctx->chunk_size &&
+            encode_flush(L, str, ctx) < 0)
+            return -1;
+    }
+
+    lua_settop(L, top);
+    return 0;
+}
+
+/*
+ * Frozen tables are serialized once, their bytes are kept in the
+ * registry and appended as is until the table is unfrozen.
+ */
+static int frozen_ref = LUA_NOREF;
+
+/* keep the bytes of a frozen element captured from the given offset */
+static void encode_captured(lua_State *L, std::string &str, int idx, size_t capture,
+    encode_ctx *ctx)
+{
+    ctx->capture--;
+    lua_pushvalue(L, idx);
+    lua_pushlstring(L, str.data() + capture, str.size() - capture);
+    lua_rawset(L, ctx->frozen);
+}
+
+/*
+ * Encode the start of the element at idx. Returns 2 if the element has
+ * a child table, its frame is filled and the table is pushed then, 0 if
+ * the element is complete, -1 on error.
+ */
+static int encode_start(
+    struct lua_State *L,
+    std::string &str,
+    int idx,
+    size_t capture,
+    encode_frame *frame,
+    encode_ctx *ctx)
+{
+    // soap lom object may be either a nil (it is omitted)
+    // or a string, or a number (it is converted to string by lua_tolstring())
+    // or a pre-serialized fragment {["raw"] = "<a/>"} appended verbatim
+    // or a generator (a function, a callable or a luafun iterator)
+    // producing children on demand
+    // or a table:
+    // soap_lom_object = {
+    //         ["tag"] = "abc",
+    //         ["attr"] = {
+    //                 ["a1"] = "A1",
+    //                 ["a2"] = "A2",
+    //         },
+    //         [1] = "inside tag abc",
+    // },
+    // which is transformed to the string
+    // [[<abc a1="A1" a2="A2">inside tag abc</abc>]]
+
+    char *msg = ctx->msg;
+    lua_getfield(L, idx, NAME_KEY);
+    // -1: lom.tag
+
+    if (lua_type(L, -1) == LUA_TNIL) {
+        lua_getfield(L, idx, RAW_KEY);
+        // -1: lom.raw
+        // -2: lom.tag
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            size_t raw_len;
+            const char *raw = lua_tolstring(L, -1, &raw_len);
+            if (ctx->validate_raw && validate_fragment(raw, raw_len, msg) < 0)
+                return -1;
+            str.append(raw, raw_len);
+            lua_pop(L, 2);
+            return 0;
+        }
+        lua_pop(L, 1);
+
+        if (is_generator(L, idx)) {
+            lua_pop(L, 1);
+            return encode_generator(L, str, idx, ctx);
+        }
+    }
+
+    if (lua_type(L, -1) != LUA_TSTRING) {
+        MARK_ERROR(msg, "encode element",
+            "Invalid table format (`" NAME_KEY "' field must be a string)");
+        return -1;
+    }
+    size_t tag_len;
+    const char *tag = lua_tolstring(L, -1, &tag_len);
+    str.push_back('<');
+    str.append(tag, tag_len);
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, ATTR_KEY);
+    // -1: lom.attr
+    // -2: tag
+
+    switch (lua_type(L, -1)) {
+    case LUA_TNIL:
+        /* DO NOTHING */
+        break;
+    case LUA_TTABLE:
+        for (lua_pushnil(L); lua_next(L,-2)!=0; lua_pop(L, 1)) {
+            // -1: value
+            // -2: key
+            // -3: lom.attr
+            // -4: tag
+
+            if (lua_type(L, -2) != LUA_TSTRING)
+            {
+                MARK_ERROR(msg, "encode element",
+                    "Invalid table format (`attr' table must have string keys and scalar values)");
+                return -1;
+            }
+
+            size_t key_len;
+            const char* key = lua_tolstring(L, -2, &key_len);
+
+            str.push_back(' ');
+            str.append(key, key_len);
+            str.append("=\"", 2);
+            if (!encode_scalar(L, str, lua_gettop(L)))
+            {
+                MARK_ERROR(msg, "encode element",
+                    "Invalid table format (`attr' table must have string keys and scalar values)");
+                return -1;
+            }
+            str.push_back('\"');
+        }
+        break;
+    default:
+        MARK_ERROR(msg, "encode element",
+            "Invalid table format (`attr' field must be a table)");
+        return -1;
+    }
+    lua_pop(L, 1);
+
+    int objlen = lua_objlen(L, idx);
+    if (objlen == 0) {
+        str.append("/>");
+        return 0;
+    } else {
+        str.push_back('>');
+    }
+
+    /* text and other leading children which are not tables are written
+     * right away, most elements have nothing else and need no frame */
+    int i = 1;
+    for (; i <= objlen; i++) {
+        lua_rawgeti(L, idx, i);
+        // -1: lom[i]
+        int type = lua_type(L, -1);
+        if (type == LUA_TTABLE)
+            break;
+        int ret = type == LUA_TSTRING ?
+            encode_text(L, str, lua_gettop(L), ctx) :
+            encode_content(L, str, lua_gettop(L), ctx);
+        if (ret < 0)
+            return -1;
+        lua_pop(L, 1);
+    }
+    if (i > objlen) {
+        str.append("</", 2);
+        str.append(tag, tag_len);
+        str.push_back('>');
+        return 0;
+    }
+
+    /* the first child table is left on the top */
+    encode_frame top = { idx, i + 1, objlen, tag, tag_len, capture };
+    *frame = top;
+    return 2;
+}
+
+/* encode_start() for tables that may be frozen */
+static int encode_open(lua_State *L, std::string &str, int idx, encode_frame *frame,
+    encode_ctx *ctx)
+{
+    if (!ctx->frozen)
+        return encode_start(L, str, idx, NO_CAPTURE, frame, ctx);
+
+    lua_pushvalue(L, idx);
+    lua_rawget(L, ctx->frozen);
+    // -1: serialized bytes, true if not serialized yet, or nil
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        size_t len;
+        const char *bytes = lua_tolstring(L, -1, &len);
+        str.append(bytes, len);
+        lua_pop(L, 1);
+        return 0;
+    }
+    bool frozen = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (!frozen)
+        return encode_start(L, str, idx, NO_CAPTURE, frame, ctx);
+
+    size_t capture = str.size();
+    ctx->capture++;
+    int ret = encode_start(L, str, idx, capture, frame, ctx);
+    if (ret == 0)
+        encode_captured(L, str, idx, capture, ctx);
+    return ret;
+}
+
+/*
+ * Encode the table at idx with its subtree. Nested elements are walked
+ * with a stack of frames instead of recursion, so the depth is not
+ * limited by the C stack. The frame of the current element is kept
+ * apart, its ancestors are in ctx->frames.
+ */
+static int encode_element(lua_State *L, std::string &str, int idx, encode_ctx *ctx)
+{
+    std::vector<encode_frame> &frames = ctx->frames.get();
+    size_t base = frames.size();
+    int spill = 0, spilled = 0;
+    int tables = 0;             /* child tables on the stack */
+    int child = idx;            /* stack index of a table to start, 0 if none */
+    bool nested = false;        /* frame is set */
+    encode_frame frame, sub;
+
+    for (;;) {
+        if (child) {
+            if (ctx->yield.every && --ctx->yield.left == 0 && yield_now(&ctx->yield) < 0) {
+                MARK_ERROR(ctx->msg, "xml encode", "fiber is cancelled");
+                goto error;
+            }
+            int ret = encode_open(L, str, child, &sub, ctx);
+            if (ret < 0)
+                goto error;
+            if (ret > 0) {
+                /* the child stays on the stack while its children are encoded */
+                if (nested) {
+                    if (!lua_checkstack(L, 8)) {
+                        MARK_ERROR(ctx->msg, "encode element", "xml encode out of stack");
+                        goto error;
+                    }
+                    frames.push_back(frame);
+                    ++tables;
+                }
+                frame = sub;
+                nested = true;
+                if (tables > FRAME_WINDOW) {
+                    /* the first child table is fetched again after */
+                    lua_pop(L, 1);
+                    frames_spill(L, tables, &spill, &spilled);
+                    frame.idx = lua_gettop(L);
+                    lua_rawgeti(L, frame.idx, frame.next - 1);
+                    tables = 1;
+                }
+                child = lua_gettop(L);
+                continue;
+            } else if (!nested) {
+                return 0;
+            } else {
+                lua_pop(L, 1);
+                if (encode_streaming(ctx) && str.size() >= ctx->chunk_size &&
+                    encode_flush(L, str, ctx) < 0)
+                    goto error;
+            }
+            child = 0;
+        }
+
+        if (frame.next <= frame.objlen) {
+            lua_rawgeti(L, frame.idx, frame.next++);
+            // -1: lom[i]
+            int type = lua_type(L, -1);
+            if (type == LUA_TTABLE) {
+                child = lua_gettop(L);
+                continue;
+            }
+            int ret = type == LUA_TSTRING ?
+                encode_text(L, str, lua_gettop(L), ctx) :
+                encode_content(L, str, lua_gettop(L), ctx);
+            if (ret < 0)
+                goto error;
+            lua_pop(L, 1);
+            if (encode_streaming(ctx) && str.size() >= ctx->chunk_size &&
+                encode_flush(L, str, ctx) < 0)
+                goto error;
+            continue;
+        }
+
+        str.append("</", 2);
+        str.append(frame.tag, frame.tag_len);
+        str.push_back('>');
+        if (frame.capture != NO_CAPTURE)
+            encode_captured(L, str, frame.idx, frame.capture, ctx);
+        if (frames.size() == base)
+            break;
+
+        /* back to the parent, the child table was pushed by it */
+        frame = frames.back();
+        frames.pop_back();
+        lua_pop(L, 1);
+        if (--tables == 0 && frames.size() > base) {
+            lua_pushnil(L);
+            int n = frames_restore(L, spill, &spilled);
+            lua_pop(L, 1);
+            /* the parent and its n - 1 nearest ancestors */
+            int top = lua_gettop(L);
+            frame.idx = top;
+            for (int i = 1; i < n; i++)
+                frames[frames.size() - i].idx = top - i;
+            tables = n;
+        }
+
+        if (encode_streaming(ctx) && str.size() >= ctx->chunk_size &&
+            encode_flush(L, str, ctx) < 0)
+            goto error;
+    }
+
+    if (spill)
+        lua_settop(L, spill - 1);
+    return 0;
+
+error:
+    frames.resize(base);
+    return -1;
+}
+
+static int encode_content(lua_State *L, std::string &str, int idx, encode_ctx *ctx)
+{
+    switch (lua_type(L, idx)) {
+    case LUA_TSTRING:
+        return encode_text(L, str, idx, ctx);
+    case LUA_TTABLE:
+        return encode_element(L, str, idx, ctx);
+    case LUA_TFUNCTION:
+        return encode_generator(L, str, idx, ctx);
+    default:
+        if (encode_scalar(L, str, idx))
+            return 0;
+        if (is_generator(L, idx))
+            return encode_generator(L, str, idx, ctx);
+        MARK_ERROR(ctx->msg, "encode element",
+            "Invalid table format (unknown content type)");
+        return -1;
+    }
+}
+
+/*
+ * Rough size of the encoded element at idx, used to allocate the output
+ * buffer once. Escaping and generators are not accounted for.
+ */
+static size_t estimate_element(lua_State *L, int idx)
+{
+    size_t size = 0;
+    if (!lua_checkstack(L, 3))
+        return 0;
 
     lua_getfield(L, idx, NAME_KEY);
-    // -1: lom.tag
+    if (lua_type(L, -1) != LUA_TSTRING) {
+        lua_pop(L, 1);
+        lua_getfield(L, idx, RAW_KEY);
+        if (lua_type(L, -1) == LUA_TSTRING)
+            size = lua_objlen(L, -1);
+        lua_pop(L, 1);
+        return size;
+    }
+    size = lua_objlen(L, -1) * 2 + 5;    /* <tag></tag> */
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, ATTR_KEY);
+    if (lua_istable(L, -1)) {
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            if (lua_type(L, -2) == LUA_TSTRING)
+                size += lua_objlen(L, -2);
+            if (lua_type(L, -1) == LUA_TSTRING)
+                size += lua_objlen(L, -1);
+            size += 4;                  /*  k="v" */
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+
+    int objlen = lua_objlen(L, idx);
+    for (int i = 1; i <= objlen; i++) {
+        lua_rawgeti(L, idx, i);
+        switch (lua_type(L, -1)) {
+        case LUA_TSTRING:
+            size += lua_objlen(L, -1);
+            break;
+        case LUA_TNUMBER:
+            size += 16;
+            break;
+        case LUA_TTABLE:
+            size += estimate_element(L, lua_gettop(L));
+            break;
+        }
+        lua_pop(L, 1);
+    }
+    return size;
+}
+
+int encode(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    xml_context *context = get_context(L);
+    char *msg = context->msg;
+    if (context->encode_options != LUA_NOREF)
+        context_options(L, 2, context->encode_options);
+    lua_settop(L, 2);
+#ifdef WITH_STATS
+    xml_stats *stats = &context->stats;
+    double start = stats->encode_calls++ % STATS_SAMPLE == 0 ? wall_time() : 0;
+#endif
+
+    encode_ctx ctx;
+    encode_ctx_init(&ctx, msg);
+    bool estimate = false;
+
+    if (!lua_isnil(L, 2))
+    {
+        if (lua_type(L, 2) != LUA_TTABLE)
+        {
+            MARK_ERROR(msg, "xml encode", "options must be a table");
+            STAT(stats->encode_errors[ENCODE_ERROR_OPTIONS]++);
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+
+        lua_getfield(L, 2, "validate_raw");
+        ctx.validate_raw = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "estimate");
+        estimate = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 2, "chunk_size");
+        if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 1)
+            ctx.chunk_size = lua_tonumber(L, -1);
+        else if (!lua_isnil(L, -1))
+        {
+            MARK_ERROR(msg, "xml encode", "`chunk_size' must be a positive number");
+            STAT(stats->encode_errors[ENCODE_ERROR_OPTIONS]++);
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+        lua_pop(L, 1);
+
+        /* either a function or an object with write() method */
+        lua_getfield(L, 2, "writer");
+        if (lua_isfunction(L, -1))
+        {
+            ctx.writer = lua_gettop(L);
+        }
+        else if (!lua_isnil(L, -1))
+        {
+            ctx.writer_self = lua_gettop(L);
+            if (lua_istable(L, -1) || luaL_getmetafield(L, -1, "__index"))
+            {
+                lua_settop(L, ctx.writer_self);
+                lua_getfield(L, ctx.writer_self, "write");
+            }
+            else
+            {
+                lua_pushnil(L);     /* it can't be indexed */
+            }
+            ctx.writer = lua_gettop(L);
+            if (!lua_isfunction(L, -1) && !luaL_getmetafield(L, -1, "__call"))
+            {
+                MARK_ERROR(msg, "xml encode",
+                    "`writer' must be a function or have write() method");
+                STAT(stats->encode_errors[ENCODE_ERROR_OPTIONS]++);
+                lua_pushnil(L);
+                lua_pushstring(L, msg);
+                return 2;
+            }
+            lua_settop(L, ctx.writer);
+        }
+        ctx.stream = ctx.writer != 0;
+
+        lua_getfield(L, 2, "ibuf");
+        if (!lua_isnil(L, -1) && encode_set_ibuf(L, -1, &ctx) < 0)
+        {
+            STAT(stats->encode_errors[ENCODE_ERROR_OPTIONS]++);
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+        lua_pop(L, 1);
+
+        if (get_yield(L, 2, &ctx.yield) < 0)
+        {
+            MARK_ERROR(msg, "xml encode", "`yield' option must be a boolean or a positive number");
+            STAT(stats->encode_errors[ENCODE_ERROR_OPTIONS]++);
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+    }
+
+    double trace_start = ENCODE_TRACED ? wall_time() : 0;
+    PROBE0(encode__start);
+
+    if (frozen_ref != LUA_NOREF)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, frozen_ref);
+        ctx.frozen = lua_gettop(L);
+    }
+
+    if (ctx.stream)
+    {
+        /* local buffer: the writer may yield or call encode() again */
+        std::string buf;
+        int ret = -1;
+        try
+        {
+#ifdef HAVE_BOX_IBUF
+            if (ctx.ibuf && estimate &&
+                box_ibuf_reserve(ctx.ibuf, estimate_element(L, 1)) == NULL)
+                throw std::bad_alloc();
+#endif
+            buf.reserve(ctx.chunk_size + ctx.chunk_size / 2);
+            ret = encode_element(L, buf, 1, &ctx);
+            if (ret == 0)
+                ret = encode_flush(L, buf, &ctx);
+        }
+        catch (const std::exception& e)
+        {
+            MARK_ERROR(msg, "xml encode fail", e.what());
+        }
+
+        if (ret < 0) {
+            STAT(stats->encode_errors[ENCODE_ERROR_FAILED]++);
+            PROBE2(encode__error, msg, probe_ns(trace_start));
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+#ifdef WITH_STATS
+        stats->encode_bytes += ctx.written;
+        if (start > 0)
+            histogram_add(&stats->encode, wall_time() - start);
+#endif
+        PROBE2(encode__done, ctx.written, probe_ns(trace_start));
+        lua_pushnumber(L, ctx.written);
+        return 1;
+    }
+
+    output_buffer buf(context);
+    std::string &out = buf.get();
+    if (estimate)
+        out.reserve(estimate_element(L, 1));
+    int ret = encode_element(L, out, 1, &ctx);
+#ifdef WITH_STATS
+    if (out.capacity() > stats->buffer_peak)
+        stats->buffer_peak = out.capacity();
+#endif
+    if (ret < 0) {
+        STAT(stats->encode_errors[ENCODE_ERROR_FAILED]++);
+        PROBE2(encode__error, msg, probe_ns(trace_start));
+        lua_pushnil(L);
+        lua_pushstring(L, msg);
+        return 2;
+   }
+
+    lua_pushlstring(L, out.c_str(), out.length());
+#ifdef WITH_STATS
+    stats->encode_bytes += out.length();
+    if (start > 0)
+        histogram_add(&stats->encode, wall_time() - start);
+#endif
+    PROBE2(encode__done, out.length(), probe_ns(trace_start));
+    return 1;
+}
+
+int freeze(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    if (frozen_ref == LUA_NOREF) {
+        /* weak keys: freezing doesn't keep tables alive */
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        frozen_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    /* freezing again drops the serialized bytes */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, frozen_ref);
+    lua_pushvalue(L, 1);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return 1;
+}
+
+int unfreeze(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    if (frozen_ref != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, frozen_ref);
+        lua_pushvalue(L, 1);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+/* ==============================TEMPLATES================================== */
+
+/*
+ * A template is a document with ${name} placeholders in text and
+ * attribute values. The static bytes around placeholders are kept
+ * as is, so rendering only escapes and copies the variable data.
+ */
+
+#define TEMPLATE_MT "luarapidxml.template"
+
+struct template_slot {
+    size_t start;       /* span of ${name} in the template text */
+    size_t end;
+};
+
+struct xml_template {
+    std::string text;
+    /* placeholder names are stored in the userdata environment */
+    std::vector<template_slot> slots;
+    xml_context *context;       /* renders into its buffer */
+    int context_ref;
+};
+
+static bool is_placeholder_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.';
+}
+
+/* find placeholders in the value, push their names to the table on top */
+static void template_scan(lua_State *L, xml_template *tmpl, const char *value, size_t len)
+{
+    const char *base = tmpl->text.data();
+    const char *end = value + len;
+    for (const char *pos = value; pos + 3 <= end; pos++) {
+        if (pos[0] != '$' || pos[1] != '{')
+            continue;
+        const char *name = pos + 2;
+        const char *name_end = name;
+        while (name_end < end && is_placeholder_char(*name_end))
+            name_end++;
+        if (name_end == name || name_end == end || *name_end != '}')
+            continue;
+
+        template_slot slot = {(size_t)(pos - base), (size_t)(name_end + 1 - base)};
+        tmpl->slots.push_back(slot);
+        lua_pushlstring(L, name, name_end - name);
+        lua_rawseti(L, -2, tmpl->slots.size());
+        pos = name_end;
+    }
+}
+
+/* scan the subtree in document order, following parent links instead of recursing */
+static void template_walk(lua_State *L, xml_template *tmpl, rapidxml::xml_node<> *root)
+{
+    rapidxml::xml_node<> *node = root;
+    while (node)
+    {
+        if (node->type() == rapidxml::node_element)
+        {
+            rapidxml::xml_attribute<> *attr = node->first_attribute();
+            for (; attr; attr = attr->next_attribute())
+                template_scan(L, tmpl, attr->value(), attr->value_size());
+            if (node->first_node()) {
+                node = node->first_node();
+                continue;
+            }
+        }
+        /* CDATA is literal, it can't hold placeholders */
+        else if (node->type() == rapidxml::node_data)
+            template_scan(L, tmpl, node->value(), node->value_size());
+
+        while (node != root && !node->next_sibling())
+            node = node->parent();
+        node = node != root ? node->next_sibling() : NULL;
+    }
+}
+
+static int template_gc(lua_State *L)
+{
+    xml_template *tmpl = (xml_template *)luaL_checkudata(L, 1, TEMPLATE_MT);
+    luaL_unref(L, LUA_REGISTRYINDEX, tmpl->context_ref);
+    tmpl->~xml_template();
+    return 0;
+}
+
+static int template_render(lua_State *L)
+{
+    xml_template *tmpl = (xml_template *)luaL_checkudata(L, 1, TEMPLATE_MT);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfenv(L, 1);
+    int names = lua_gettop(L);
+    char *msg = tmpl->context->msg;
+    /* values may have __index metamethods rendering again */
+    output_buffer buf(tmpl->context);
+    std::string &res = buf.get();
+
+    const char *text = tmpl->text.data();
+    size_t pos = 0;
+    for (size_t i = 0; i < tmpl->slots.size(); i++) {
+        const template_slot &slot = tmpl->slots[i];
+        res.append(text + pos, slot.start - pos);
+        pos = slot.end;
+
+        lua_rawgeti(L, names, i + 1);
+        lua_pushvalue(L, -1);
+        lua_gettable(L, 2);
+        // -1: value
+        // -2: name
+        if (!encode_scalar(L, res, lua_gettop(L)))
+        {
+            MARK_ERROR(msg, "xml template: missing value for placeholder",
+                lua_tostring(L, -2));
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+        lua_pop(L, 2);
+    }
+    res.append(text + pos, tmpl->text.size() - pos);
+
+    lua_pushlstring(L, res.data(), res.size());
+    return 1;
+}
+
+int compile_template(lua_State *L)
+{
+    xml_context *context = get_context(L);
+    char *msg = context->msg;
+    luaL_argcheck(L, lua_type(L, 1) == LUA_TSTRING || lua_type(L, 1) == LUA_TTABLE, 1,
+        "string or table expected");
+    output_buffer buf(context);
+    std::string &res = buf.get();
+    encode_ctx ctx;
+    encode_ctx_init(&ctx, msg);
+
+    switch (lua_type(L, 1)) {
+    case LUA_TSTRING:
+    {
+        size_t len;
+        const char *str = lua_tolstring(L, 1, &len);
+        res.assign(str, len);
+        break;
+    }
+    case LUA_TTABLE:
+        if (encode_element(L, res, 1, &ctx) < 0)
+        {
+            lua_pushnil(L);
+            lua_pushstring(L, msg);
+            return 2;
+        }
+        break;
+    }
+
+    xml_template *tmpl = (xml_template *)lua_newuserdata(L, sizeof(xml_template));
+    new (tmpl) xml_template();
+    tmpl->context = context;
+    tmpl->context_ref = LUA_NOREF;
+    if (luaL_newmetatable(L, TEMPLATE_MT))
+    {
+        static const struct luaL_Reg methods [] = {
+            {"render", template_render},
+            {NULL, NULL}
+        };
+        luaL_newlib(L, methods);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, template_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    tmpl->context_ref = context_ref(L);
+    lua_newtable(L);
+    // -1: placeholder names
+    // -2: template
+
+    int ret = 0;
+    {
+        tmpl->text.swap(res);
+        rapidxml::xml_document<> doc;
+        try
+        {
+            /* never modify the template text */
+            const char *error = parse_document<rapidxml::parse_non_destructive>(
+                doc, &tmpl->text[0]);
+            rapidxml::xml_node<> *root = doc.first_node();
+            if (error)
+            {
+                MARK_ERROR(msg, "invalid xml string", error);
+                ret = -1;
+            }
+            else if (root && root->type() == rapidxml::node_element)
+            {
+                template_walk(L, tmpl, root);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            MARK_ERROR(msg, "xml template fail", e.what());
+            ret = -1;
+        }
+        doc.clear();
+    }
+
+    if (ret < 0)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, msg);
+        return 2;
+    }
+
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+/* ===========================RECORD ENCODER================================ */
+
+/*
+ * compile_encoder() turns a schema describing plain Lua records into
+ * a flat list of precomputed tags, so records are written as XML
+ * directly, without building an intermediate LOM:
+ *
+ * schema = {
+ *     tag = "order",
+ *     attr = {"id", {field = "kind", name = "type"}},
+ *     text = "note",
+ *     children = {
+ *         "name",                                 -- <name>rec.name</name>
+ *         {tag = "customer", children = {...}},   -- nested record
+ *         {tag = "item", field = "items", list = true},
+ *     },
+ * }
+ *
+ * Field names are interned once and kept in the userdata environment,
+ * so every lookup at encode time reuses the same Lua string.
+ */
+
+#define ENCODER_MT "luarapidxml.encoder"
+
+struct record_field {
+    int key;            /* index of the field name in the environment */
+    std::string prefix; /* ` name="` of an attribute */
+    int schema;         /* schema of a child element */
+    bool list;          /* child value is an array of elements */
+};
+
+struct record_schema {
+    std::string open;   /* "<tag" */
+    std::string close;  /* "</tag>" */
+    std::vector<record_field> attrs;
+    std::vector<record_field> children;
+    int text;           /* key of the text field, 0 if none */
+};
+
+struct record_encoder {
+    std::vector<record_schema> schemas;   /* the root schema is the first */
+    xml_context *context;       /* encodes into its buffer */
+    int context_ref;
+};
+
+/* intern the field name on top of the stack, pop it */
+static int record_key(lua_State *L, int env)
+{
+    int key = lua_objlen(L, env) + 1;
+    lua_rawseti(L, env, key);
+    return key;
+}
+
+static int compile_schema(lua_State *L, record_encoder *enc, int env, int seen, char *msg);
+
+/* compile a child element spec on top of the stack into field */
+static int compile_child(lua_State *L, record_encoder *enc, int env, int seen,
+    record_field &field, char *msg)
+{
+    int spec = lua_gettop(L);
+    field.list = false;
+
+    if (lua_type(L, spec) == LUA_TSTRING) {
+        /* "name" is a shorthand for {tag = "name"} */
+        lua_createtable(L, 0, 1);
+        lua_pushvalue(L, spec);
+        lua_setfield(L, -2, NAME_KEY);
+        lua_pushvalue(L, spec);
+        field.key = record_key(L, env);
+    } else if (lua_type(L, spec) == LUA_TTABLE) {
+        lua_getfield(L, spec, "field");
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_getfield(L, spec, NAME_KEY);
+        }
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            MARK_ERROR(msg, "compile encoder",
+                "child must have a string `tag' or `field'");
+            return -1;
+        }
+        field.key = record_key(L, env);
+        lua_getfield(L, spec, "list");
+        field.list = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        lua_pushvalue(L, spec);
+    } else {
+        MARK_ERROR(msg, "compile encoder", "child must be a string or a table");
+        return -1;
+    }
+
+    field.schema = compile_schema(L, enc, env, seen, msg);
+    lua_settop(L, spec);
+    return field.schema < 0 ? -1 : 0;
+}
+
+/* compile the schema on top of the stack, return its index */
+static int compile_schema(lua_State *L, record_encoder *enc, int env, int seen, char *msg)
+{
+    luaL_checkstack(L, 8, "compile encoder out of stack");
+    int spec = lua_gettop(L);
+
+    /* schemas may refer to themselves to describe trees */
+    lua_pushvalue(L, spec);
+    lua_rawget(L, seen);
+    if (!lua_isnil(L, -1)) {
+        int idx = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        return idx;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, spec, NAME_KEY);
+    if (lua_type(L, -1) != LUA_TSTRING) {
+        MARK_ERROR(msg, "compile encoder", "`tag' field must be a string");
+        return -1;
+    }
+    int idx = enc->schemas.size();
+    enc->schemas.push_back(record_schema());
+    lua_pushvalue(L, spec);
+    lua_pushinteger(L, idx);
+    lua_rawset(L, seen);
+
+    size_t tag_len;
+    const char *tag = lua_tolstring(L, -1, &tag_len);
+    enc->schemas[idx].open.append("<", 1).append(tag, tag_len);
+    enc->schemas[idx].close.append("</", 2).append(tag, tag_len).append(">", 1);
+    enc->schemas[idx].text = 0;
+    lua_pop(L, 1);
+
+    lua_getfield(L, spec, "text");
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        enc->schemas[idx].text = record_key(L, env);
+    } else if (!lua_isnil(L, -1)) {
+        MARK_ERROR(msg, "compile encoder", "`text' field must be a string");
+        return -1;
+    } else {
+        lua_pop(L, 1);
+    }
+
+    lua_getfield(L, spec, ATTR_KEY);
+    if (!lua_isnil(L, -1) && !lua_istable(L, -1)) {
+        MARK_ERROR(msg, "compile encoder", "`attr' field must be a table");
+        return -1;
+    }
+    int attrs = lua_gettop(L);
+    int n = lua_isnil(L, attrs) ? 0 : lua_objlen(L, attrs);
+    for (int i = 1; i <= n; i++) {
+        /* "id" or {field = "id", name = "ID"} */
+        lua_rawgeti(L, attrs, i);
+        if (lua_istable(L, -1)) {
+            lua_getfield(L, -1, "field");
+            lua_getfield(L, -2, "name");
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                lua_pushvalue(L, -1);
+            }
+        } else {
+            lua_pushvalue(L, -1);
+            lua_pushvalue(L, -1);
+        }
+        // -1: attribute name
+        // -2: field name
+        if (lua_type(L, -1) != LUA_TSTRING || lua_type(L, -2) != LUA_TSTRING) {
+            MARK_ERROR(msg, "compile encoder",
+                "`attr' must list field names or {field = ..., name = ...}");
+            return -1;
+        }
+        record_field field;
+        size_t name_len;
+        const char *name = lua_tolstring(L, -1, &name_len);
+        field.prefix.append(" ", 1).append(name, name_len).append("=\"", 2);
+        lua_pop(L, 1);
+        field.key = record_key(L, env);
+        field.schema = -1;
+        field.list = false;
+        enc->schemas[idx].attrs.push_back(field);
+        lua_settop(L, attrs);
+    }
+    lua_settop(L, spec);
+
+    lua_getfield(L, spec, "children");
+    if (!lua_isnil(L, -1) && !lua_istable(L, -1)) {
+        MARK_ERROR(msg, "compile encoder", "`children' field must be a table");
+        return -1;
+    }
+    int children = lua_gettop(L);
+    n = lua_isnil(L, children) ? 0 : lua_objlen(L, children);
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, children, i);
+        record_field field;
+        if (compile_child(L, enc, env, seen, field, msg) < 0)
+            return -1;
+        /* the vector may be reallocated by compile_child() */
+        enc->schemas[idx].children.push_back(field);
+        lua_settop(L, children);
+    }
+    lua_settop(L, spec);
+    return idx;
+}
+
+/* append a scalar value on top of the stack */
+static int record_scalar(lua_State *L, std::string &out, char *msg)
+{
+    if (encode_scalar(L, out, lua_gettop(L)))
+        return 0;
+    MARK_ERROR(msg, "record encode", "unsupported field value type");
+    return -1;
+}
+
+static int encode_record(lua_State *L, const record_encoder *enc, int schema,
+    int rec, int env, std::string &out, char *msg);
+
+/* append a child element for the value on top of the stack */
+static int record_child(lua_State *L, const record_encoder *enc, int schema,
+    int env, std::string &out, char *msg)
+{
+    if (lua_istable(L, -1))
+        return encode_record(L, enc, schema, lua_gettop(L), env, out, msg);
+
+    const record_schema &s = enc->schemas[schema];
+    out.append(s.open).push_back('>');
+    if (record_scalar(L, out, msg) < 0)
+        return -1;
+    out.append(s.close);
+    return 0;
+}
+
+static int encode_record(lua_State *L, const record_encoder *enc, int schema,
+    int rec, int env, std::string &out, char *msg)
+{
+    if (!lua_checkstack(L, 5))
+    {
+        MARK_ERROR(msg, "record encode", "xml encode out of stack");
+        return -1;
+    }
+
+    const record_schema &s = enc->schemas[schema];
+    out.append(s.open);
+
+    for (size_t i = 0; i < s.attrs.size(); i++) {
+        lua_rawgeti(L, env, s.attrs[i].key);
+        lua_gettable(L, rec);
+        if (!lua_isnil(L, -1)) {
+            out.append(s.attrs[i].prefix);
+            if (record_scalar(L, out, msg) < 0)
+                return -1;
+            out.push_back('"');
+        }
+        lua_pop(L, 1);
+    }
+
+    size_t content = out.size();
+    out.push_back('>');
+
+    if (s.text) {
+        lua_rawgeti(L, env, s.text);
+        lua_gettable(L, rec);
+        if (!lua_isnil(L, -1) && record_scalar(L, out, msg) < 0)
+            return -1;
+        lua_pop(L, 1);
+    }
+
+    for (size_t i = 0; i < s.children.size(); i++) {
+        const record_field &child = s.children[i];
+        lua_rawgeti(L, env, child.key);
+        lua_gettable(L, rec);
+        int value = lua_gettop(L);
+        if (lua_isnil(L, value)) {
+            /* omitted */
+        } else if (!child.list) {
+            if (record_child(L, enc, child.schema, env, out, msg) < 0)
+                return -1;
+        } else if (lua_istable(L, value)) {
+            int n = lua_objlen(L, value);
+            for (int j = 1; j <= n; j++) {
+                lua_rawgeti(L, value, j);
+                if (record_child(L, enc, child.schema, env, out, msg) < 0)
+                    return -1;
+                lua_pop(L, 1);
+            }
+        } else {
+            MARK_ERROR(msg, "record encode", "list field must be a table");
+            return -1;
+        }
+        lua_settop(L, value - 1);
+    }
+
+    if (out.size() == content + 1) {
+        out.resize(content);
+        out.append("/>", 2);
+    } else {
+        out.append(s.close);
+    }
+    return 0;
+}
+
+static int encoder_gc(lua_State *L)
+{
+    record_encoder *enc = (record_encoder *)luaL_checkudata(L, 1, ENCODER_MT);
+    luaL_unref(L, LUA_REGISTRYINDEX, enc->context_ref);
+    enc->~record_encoder();
+    return 0;
+}
+
+static int encoder_encode(lua_State *L)
+{
+    record_encoder *enc = (record_encoder *)luaL_checkudata(L, 1, ENCODER_MT);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_getfenv(L, 1);
+    char *msg = enc->context->msg;
+    /* fields may have __index metamethods encoding again */
+    output_buffer buf(enc->context);
+    std::string &res = buf.get();
+
+    if (encode_record(L, enc, 0, 2, 3, res, msg) < 0)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, msg);
+        return 2;
+    }
+
+    lua_pushlstring(L, res.data(), res.size());
+    return 1;
+}
+
+int compile_encoder(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    xml_context *context = get_context(L);
+    char *msg = context->msg;
+
+    record_encoder *enc = (record_encoder *)lua_newuserdata(L, sizeof(record_encoder));
+    new (enc) record_encoder();
+    enc->context = context;
+    enc->context_ref = LUA_NOREF;
+    if (luaL_newmetatable(L, ENCODER_MT))
+    {
+        static const struct luaL_Reg methods [] = {
+            {"encode", encoder_encode},
+            {NULL, NULL}
+        };
+        luaL_newlib(L, methods);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, encoder_encode);
+        lua_setfield(L, -2, "__call");
+        lua_pushcfunction(L, encoder_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, 2);
+    enc->context_ref = context_ref(L);
+
+    lua_newtable(L);    /* field names */
+    lua_newtable(L);    /* compiled schemas */
+    lua_pushvalue(L, 1);
+    // -1: schema
+    // -2: compiled schemas
+    // -3: field names
+    // -4: encoder
+
+    int ret = 0;
+    try
+    {
+        ret = compile_schema(L, enc, 3, 4, msg);
+    }
+    catch (const std::exception& e)
+    {
+        MARK_ERROR(msg, "compile encoder fail", e.what());
+        ret = -1;
+    }
+
+    if (ret < 0)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, msg);
+        return 2;
+    }
+
+    lua_settop(L, 3);
+    lua_setfenv(L, 2);
+    return 1;
+}
+
+/* ================================PATCH==================================== */
+
+/*
+ * patch() edits a document without building a LOM: the source is
+ * parsed once to locate byte spans, and the result is assembled by
+ * copying untouched bytes between the edited spans.
+ */
+
+struct patch_edit {
+    size_t start;       /* source span replaced with the text */
+    size_t end;
+    std::string text;
+};
+
+static bool patch_edit_before(const patch_edit &a, const patch_edit &b)
+{
+    return a.start < b.start || (a.start == b.start && a.end < b.end);
+}
+
+/* first element in document order matching path[i..] below node */
+static rapidxml::xml_node<> *find_path(rapidxml::xml_node<> *node,
+    const std::vector<xml_name> &path, size_t i)
+{
+    if (i == path.size())
+        return node;
+    for (rapidxml::xml_node<> *sub = node->first_node(); sub; sub = sub->next_sibling())
+    {
+        if (sub->type() != rapidxml::node_element ||
+            !name_matches(path[i], sub->name(), sub->name_size()))
+            continue;
+        rapidxml::xml_node<> *found = find_path(sub, path, i + 1);
+        if (found)
+            return found;
+    }
+    return NULL;
+}
+
+/* position of '>' or "/>" that closes the start tag of an element */
+static const char *start_tag_end(rapidxml::xml_node<> *node)
+{
+    const char *pos = node->name() + node->name_size();
+    rapidxml::xml_attribute<> *attr = node->last_attribute();
+    if (attr)
+        pos = attr->value() + attr->value_size() + 1 /* quote */;
+    while (*pos != '>' && *pos != '/')
+        pos++;
+    return pos;
+}
+
+/* position of "</" that opens the closing tag of a non-empty element */
+static const char *closing_tag_start(rapidxml::xml_node<> *node)
+{
+    /* neither the closing tag name nor whitespace can contain '/' */
+    const char *pos = node->source_end() - 1;
+    while (*pos != '/')
+        pos--;
+    return pos - 1;
+}
+
+/* escape the value at the top of the stack into the edit text */
+static int patch_value(lua_State *L, std::string &text, char *msg)
+{
+    if (encode_scalar(L, text, lua_gettop(L)))
+        return 0;
+    MARK_ERROR(msg, "xml patch",
+        "`set' value must be a string, a number, a boolean or a 64-bit integer");
+    return -1;
+}
+
+/* translate an operation at the top of the stack into an edit */
+static int patch_op(lua_State *L, const char *str, rapidxml::xml_node<> *root,
+    std::vector<patch_edit> &edits, char *msg)
+{
+    if (lua_type(L, -1) != LUA_TTABLE)
+    {
+        MARK_ERROR(msg, "xml patch", "operation must be a table");
+        return -1;
+    }
+
+    lua_getfield(L, -1, "path");
+    size_t path_len;
+    const char *path = lua_tolstring(L, -1, &path_len);
+    std::vector<xml_name> segs;
+    if (lua_type(L, -1) != LUA_TSTRING || split_path(path, path_len, segs) < 0)
+    {
+        MARK_ERROR(msg, "xml patch", "`path' must be a string like \"a/b\" or \"a/b/@c\"");
+        return -1;
+    }
+
+    xml_name attr_name = {NULL, 0};
+    if (segs.back().str[0] == '@')
+    {
+        attr_name.str = segs.back().str + 1;
+        attr_name.len = segs.back().len - 1;
+        segs.pop_back();
+        if (attr_name.len == 0 || segs.empty())
+        {
+            MARK_ERROR(msg, "xml patch", "`path' must be a string like \"a/b\" or \"a/b/@c\"");
+            return -1;
+        }
+    }
+
+    rapidxml::xml_node<> *node = NULL;
+    if (name_matches(segs[0], root->name(), root->name_size()))
+        node = find_path(root, segs, 1);
+    if (node == NULL)
+    {
+        MARK_ERROR(msg, "xml patch: element not found", path);
+        return -1;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "remove");
+    bool remove = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "set");
+    if (remove != (lua_isnil(L, -1) != 0))
+    {
+        MARK_ERROR(msg, "xml patch", "operation must have either `set' or `remove' field");
+        return -1;
+    }
+
+    patch_edit edit;
+    const char *tag_end = start_tag_end(node);
+    const char *name = node->name();
+    if (attr_name.str != NULL)
+    {
+        rapidxml::xml_attribute<> *attr = node->first_attribute();
+        for (; attr; attr = attr->next_attribute())
+            if (name_matches(attr_name, attr->name(), attr->name_size()))
+                break;
+
+        if (attr && remove)
+        {
+            /* along with the whitespace preceding the attribute */
+            const char *start = attr->name();
+            while (start[-1] == ' ' || start[-1] == '\t' ||
+                   start[-1] == '\n' || start[-1] == '\r')
+                start--;
+            edit.start = start - str;
+            edit.end = attr->value() + attr->value_size() + 1 - str;
+        }
+        else if (attr)
+        {
+            edit.start = attr->value() - str;
+            edit.end = edit.start + attr->value_size();
+            if (patch_value(L, edit.text, msg) < 0)
+                return -1;
+        }
+        else if (remove)
+        {
+            lua_pop(L, 1);
+            return 0;
+        }
+        else
+        {
+            edit.start = edit.end = tag_end - str;
+            edit.text.push_back(' ');
+            edit.text.append(attr_name.str, attr_name.len);
+            edit.text.append("=\"", 2);
+            if (patch_value(L, edit.text, msg) < 0)
+                return -1;
+            edit.text.push_back('"');
+        }
+    }
+    else if (remove)
+    {
+        if (node == root)
+        {
+            MARK_ERROR(msg, "xml patch", "root element can't be removed");
+            return -1;
+        }
+        edit.start = name - 1 - str;
+        edit.end = node->source_end() - str;
+    }
+    else if (*tag_end == '/')
+    {
+        /* <a/> turns into <a>value</a> */
+        edit.start = tag_end - str;
+        edit.end = node->source_end() - str;
+        edit.text.push_back('>');
+        if (patch_value(L, edit.text, msg) < 0)
+            return -1;
+        edit.text.append("</", 2);
+        edit.text.append(name, node->name_size());
+        edit.text.push_back('>');
+    }
+    else
+    {
+        edit.start = tag_end + 1 - str;
+        edit.end = closing_tag_start(node) - str;
+        if (patch_value(L, edit.text, msg) < 0)
+            return -1;
+    }
+    lua_pop(L, 1);
+
+    edits.push_back(edit);
+    return 0;
+}
+
+static int patch_document(lua_State *L, const char *str, size_t len,
+    rapidxml::xml_node<> *root, std::string &res, char *msg)
+{
+    if (!root || root->type() != rapidxml::node_element)
+    {
+        MARK_ERROR(msg, "xml patch", "not a xml element");
+        return -1;
+    }
+
+    std::vector<patch_edit> edits;
+    int n = lua_objlen(L, 2);
+    for (int i = 1; i <= n; i++)
+    {
+        lua_rawgeti(L, 2, i);
+        int top = lua_gettop(L);
+        int ret = patch_op(L, str, root, edits, msg);
+        lua_settop(L, top - 1);
+        if (ret < 0)
+            return -1;
+    }
+
+    std::stable_sort(edits.begin(), edits.end(), patch_edit_before);
+
+    size_t res_len = len;
+    for (size_t i = 0; i < edits.size(); i++)
+    {
+        if (i > 0 && edits[i].start < edits[i-1].end)
+        {
+            MARK_ERROR(msg, "xml patch", "operations affect overlapping parts of the document");
+            return -1;
+        }
+        res_len += edits[i].text.size() - (edits[i].end - edits[i].start);
+    }
+
+    res.reserve(res_len);
+    size_t pos = 0;
+    for (size_t i = 0; i < edits.size(); i++)
+    {
+        res.append(str + pos, edits[i].start - pos);
+        res.append(edits[i].text);
+        pos = edits[i].end;
+    }
+    res.append(str + pos, len - pos);
+    return 0;
+}
+
+int patch(lua_State *L)
+{
+    size_t len = 0;
+    const char *str = luaL_checklstring(L, 1, &len);
+    char *msg = get_context(L)->msg;
+    luaL_checktype(L, 2, LUA_TTABLE);
 
-    if (lua_type(L, -1) != LUA_TSTRING) {
-        MARK_ERROR(msg, "encode element",
-            "Invalid table format (`" NAME_KEY "' field must be a string)");
-        return -1;
+    int ret = 0;
+    std::string res;
+    {
+        rapidxml::xml_document<> doc;
+        try
+        {
+            /* never modify str */
+            const char *error = parse_document<rapidxml::parse_non_destructive>(
+                doc, const_cast<char*>(str));
+            if (error)
+            {
+                MARK_ERROR(msg, "invalid xml string", error);
+                ret = -1;
+            }
+            else
+            {
+                ret = patch_document(L, str, len, doc.first_node(), res, msg);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            MARK_ERROR(msg, "xml patch fail", e.what());
+            ret = -1;
+        }
+        catch (...)
+        {
+            MARK_ERROR(msg, "xml patch fail", "unknow error");
+            ret = -1;
+        }
+
+        doc.clear();
     }
-    size_t tag_len;
-    const char *tag = lua_tolstring(L, -1, &tag_len);
-    str.push_back('<');
-    str.append(tag, tag_len);
-    lua_pop(L, 1);
 
-    lua_getfield(L, idx, ATTR_KEY);
-    // -1: lom.attr
-    // -2: tag
+    if (ret < 0)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, msg);
+        return 2;
+    }
 
-    switch (lua_type(L, -1)) {
-    case LUA_TNIL:
-        /* DO NOTHING */
-        break;
-    case LUA_TTABLE:
-        for (lua_pushnil(L); lua_next(L,-2)!=0; lua_pop(L, 1)) {
-            // -1: value
-            // -2: key
-            // -3: lom.attr
-            // -4: tag
+    lua_pushlstring(L, res.data(), res.size());
+    return 1;
+}
 
-            if ( lua_type(L, -1) != LUA_TSTRING || lua_type(L, -2) != LUA_TSTRING )
-            {
-                MARK_ERROR(msg, "encode element",
-                    "Invalid table format (`attr' table must have string keys and values)");
-                return -1;
+/* ==============================VALIDATION================================= */
+
+/*
+ * Return the first '&' not starting a reference decode() understands,
+ * or NULL. *what is set to the error description.
+ */
+static const char *check_entities(const char *str, size_t len, const char **what)
+{
+    static const char *const names[] = {"lt;", "gt;", "amp;", "apos;", "quot;"};
+    const char *end = str + len;
+    const char *pos = (const char *)memchr(str, '&', len);
+    for (; pos != NULL; pos = (const char *)memchr(pos + 1, '&', end - pos - 1)) {
+        const char *ref = pos + 1;
+        size_t left = end - ref;
+        bool known = false;
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]) && !known; i++) {
+            size_t n = strlen(names[i]);
+            known = left >= n && memcmp(ref, names[i], n) == 0;
+        }
+        if (known)
+            continue;
+
+        *what = "invalid escape sequence";
+        if (left < 3 || *ref != '#')
+            return pos;
+        ref++;
+        bool hex = *ref == 'x';
+        if (hex)
+            ref++;
+        uint32_t codepoint = 0;
+        const char *digits = ref;
+        for (; ref < end; ref++) {
+            int d;
+            if (*ref >= '0' && *ref <= '9')
+                d = *ref - '0';
+            else if (hex && *ref >= 'a' && *ref <= 'f')
+                d = *ref - 'a' + 10;
+            else if (hex && *ref >= 'A' && *ref <= 'F')
+                d = *ref - 'A' + 10;
+            else
+                break;
+            codepoint = codepoint * (hex ? 16 : 10) + d;
+            if (codepoint > 0x1fffff) {
+                *what = "invalid unicode codepoint";
+                return pos;
             }
+        }
+        if (ref == digits || ref == end || *ref != ';')
+            return pos;
+    }
+    return NULL;
+}
 
-            size_t key_len;
-            const char* key = lua_tolstring(L, -2, &key_len);
+/*
+ * Check entity references in the subtree of root, returns the first
+ * bad '&' or NULL. Only values the parser saw '&' in need checking.
+ */
+static const char *check_tree_entities(rapidxml::xml_node<> *root, const char **what)
+{
+    rapidxml::xml_node<> *node = root;
+    while (node)
+    {
+        const char *where = NULL;
+        if (node->type() == rapidxml::node_data && node->value_escaped())
+            where = check_entities(node->value(), node->value_size(), what);
+        for (rapidxml::xml_attribute<> *attr = node->first_attribute();
+             attr && !where; attr = attr->next_attribute())
+        {
+            if (attr->value_escaped())
+                where = check_entities(attr->value(), attr->value_size(), what);
+        }
+        if (where)
+            return where;
 
-            str.push_back(' ');
-            str.append(key, key_len);
-            str.append("=\"", 2);
-            encode_string(L, str, lua_gettop(L));
-            str.push_back('\"');
+        /* next node in document order */
+        if (node->first_node())
+        {
+            node = node->first_node();
+            continue;
         }
-        break;
-    default:
-        MARK_ERROR(msg, "encode element",
-            "Invalid table format (`attr' field must be a table)");
-        return -1;
+        while (node && node != root && !node->next_sibling())
+            node = node->parent();
+        node = node && node != root ? node->next_sibling() : NULL;
     }
-    lua_pop(L, 1);
+    return NULL;
+}
 
-    int objlen = lua_objlen(L, idx);
-    if (objlen == 0) {
-        str.append("/>");
-        return 0;
-    } else {
-        str.push_back('>');
+/*
+ * Check the document is well-formed without decoding it: one root
+ * element, matching closing tags and valid entity references.
+ */
+int validate(lua_State *L)
+{
+    size_t len = 0;
+    const char *str = luaL_checklstring(L, 1, &len);
+    char *msg = get_context(L)->msg;
+    bool closing_tags = true;
+    bool entities = true;
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "validate_closing_tags");
+        closing_tags = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        lua_getfield(L, 2, "validate_entities");
+        entities = lua_isnil(L, -1) || lua_toboolean(L, -1);
+        lua_pop(L, 1);
     }
 
-    for (int i = 1; i <= objlen; i++) {
-        lua_rawgeti(L, idx, i);
-        // -1: lom[i]
-        // -2: lom.attr
-        // -3: tag
+    const char *where = NULL;
+    rapidxml::xml_document<> doc;
+    try
+    {
+        /* never modify str, data nodes are enough to check values */
+        const int flags = PARSE_ND | rapidxml::parse_no_element_values;
+        const char *error = closing_tags ?
+            parse_document<flags | PARSE_V>(doc, const_cast<char*>(str), &where) :
+            parse_document<flags>(doc, const_cast<char*>(str), &where);
 
-        switch (lua_type(L, -1)) {
-        case LUA_TSTRING:
+        rapidxml::xml_node<> *root = doc.first_node();
+        if (error)
         {
-            encode_string(L, str, lua_gettop(L));
-            break;
+            MARK_ERROR(msg, "invalid xml string", error);
         }
-        case LUA_TNUMBER:
+        else if (root == NULL)
         {
-            size_t buf_len;
-            const char *str_buf = lua_tolstring(L, -1, &buf_len);
-            str.append(str_buf, buf_len);
-            break;
+            MARK_ERROR(msg, "xml validate", "no root element");
+            where = str + len;
         }
-        case LUA_TTABLE: {
-            int ret = encode_element(L, str, lua_gettop(L), msg);
-            if (ret < 0)
-                return -1;
-            else
-                break;
+        else if (root->next_sibling(NULL, 0) != NULL)
+        {
+            MARK_ERROR(msg, "xml validate", "more than one root element");
+            where = root->next_sibling(NULL, 0)->name() - 1;
         }
-        default:
-            MARK_ERROR(msg, "encode element",
-                "Invalid table format (unknown content type)");
-            return -1;
+
+        if (entities && !where)
+        {
+            const char *what = NULL;
+            where = check_tree_entities(root, &what);
+            if (where)
+            {
+                MARK_ERROR(msg, "xml validate", what);
+            }
         }
+    }
+    catch (const std::exception& e)
+    {
+        MARK_ERROR(msg, "xml validate fail", e.what());
+        where = str;
+    }
+    doc.clear();
 
-        lua_pop(L, 1);
-        // -1: lom.attr
-        // -2: tag
+    if (where)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, msg);
+        lua_pushinteger(L, where - str);
+        return 3;
     }
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-    str.append("</", 2);
-    str.append(tag, tag_len);
-    str.push_back('>');
-    return 0;
+/* ================================LOOKUP=================================== */
+
+/*
+ * get() scans the document once without building a DOM or a LOM and
+ * stops as soon as the path is resolved. Subtrees off the path are
+ * passed over by counting tags.
+ */
+
+struct xml_scan {
+    const char *pos;
+    const char *end;
+    const char *what;   /* error description */
+};
+
+static bool scan_error(xml_scan *sc, const char *what)
+{
+    sc->what = what;
+    return false;
 }
 
-static std::string res;
+/* move past the next occurrence of lit */
+static bool scan_past(xml_scan *sc, const char *lit, size_t len)
+{
+    const char *p = sc->pos;
+    while ((p = (const char *)memchr(p, lit[0], sc->end - p)) != NULL) {
+        if ((size_t)(sc->end - p) >= len && memcmp(p, lit, len) == 0) {
+            sc->pos = p + len;
+            return true;
+        }
+        p++;
+    }
+    return scan_error(sc, "unexpected end of data");
+}
 
-int encode(lua_State *L)
+static bool scan_space(char c)
 {
-    luaL_checktype(L, 1, LUA_TTABLE);
-    res.clear();
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* skip <!DOCTYPE ...> with an optional [internal subset] */
+static bool scan_doctype(xml_scan *sc)
+{
+    int brackets = 0;
+    for (const char *p = sc->pos; p < sc->end; p++) {
+        if (*p == '[')
+            brackets++;
+        else if (*p == ']')
+            brackets--;
+        else if (*p == '>' && brackets <= 0) {
+            sc->pos = p + 1;
+            return true;
+        }
+    }
+    return scan_error(sc, "unexpected end of data");
+}
+
+/*
+ * Scan a start tag, sc->pos is past '<'. Attributes are left unparsed
+ * between *attrs and the returned end of the tag.
+ */
+static bool scan_start_tag(xml_scan *sc, xml_name *name, const char **attrs,
+    bool *empty)
+{
+    const char *p = sc->pos;
+    while (p < sc->end && !scan_space(*p) && *p != '/' && *p != '>')
+        p++;
+    if (p == sc->pos)
+        return scan_error(sc, "expected element name");
+    name->str = sc->pos;
+    name->len = p - sc->pos;
+    *attrs = p;
 
-    int ret = encode_element(L, res, 1, msg);
+    for (; p < sc->end; p++) {
+        if (*p == '"' || *p == '\'') {
+            p = (const char *)memchr(p + 1, *p, sc->end - p - 1);
+            if (p == NULL)
+                break;
+        } else if (*p == '>') {
+            *empty = p[-1] == '/';
+            sc->pos = p + 1;
+            return true;
+        }
+    }
+    return scan_error(sc, "unexpected end of data");
+}
+
+/* push the decoded value of the attribute in [p, end) of a start tag */
+static int scan_attribute(lua_State *L, const char *p, const char *end,
+    const xml_name &attr, char *msg)
+{
+    while (p < end) {
+        while (p < end && scan_space(*p))
+            p++;
+        const char *name = p;
+        while (p < end && *p != '=' && !scan_space(*p) && *p != '/' && *p != '>')
+            p++;
+        size_t name_len = p - name;
+        while (p < end && scan_space(*p))
+            p++;
+        if (name_len == 0 || p == end || *p != '=')
+            break;
+        p++;
+        while (p < end && scan_space(*p))
+            p++;
+        if (p == end || (*p != '"' && *p != '\''))
+            break;
+        const char *value = p + 1;
+        p = (const char *)memchr(value, *p, end - value);
+        if (p == NULL)
+            break;
+        if (name_matches(attr, name, name_len))
+            return decode_string(L, value, p - value, msg) < 0 ? -1 : 1;
+        p++;
+    }
+    return 0;
+}
+
+int get(lua_State *L)
+{
+    size_t len;
+    const char *str = luaL_checklstring(L, 1, &len);
+    char *msg = get_context(L)->msg;
+    size_t path_len;
+    const char *path = luaL_checklstring(L, 2, &path_len);
+
+    /* "a/b/c" or "a/b/@attr", starting with the root element */
+    std::vector<xml_name> segs;
+    xml_name attr = {NULL, 0};
+    int ret = split_path(path, path_len, segs);
+    if (ret == 0 && segs.back().str[0] == '@') {
+        attr.str = segs.back().str + 1;
+        attr.len = segs.back().len - 1;
+        segs.pop_back();
+        if (attr.len == 0 || segs.empty())
+            ret = -1;
+    }
+    for (size_t i = 0; ret == 0 && i < segs.size(); i++) {
+        if (segs[i].str[0] == '@')
+            ret = -1;
+    }
     if (ret < 0) {
+        MARK_ERROR(msg, "xml get", "invalid path");
         lua_pushnil(L);
         lua_pushstring(L, msg);
         return 2;
-   }
+    }
+
+    xml_scan sc = {str, str + len, NULL};
+    size_t depth = 0;       /* open elements */
+    size_t matched = 0;     /* path segments matched by open elements */
+    size_t collect = 0;     /* depth of the element whose text is returned */
+    int parts = 0;
+    bool root_seen = false;
+
+    while (sc.what == NULL) {
+        const char *lt = (const char *)memchr(sc.pos, '<', sc.end - sc.pos);
+        const char *text_end = lt ? lt : sc.end;
+        if (collect && depth == collect && text_end > sc.pos) {
+            luaL_checkstack(L, 2, "xml get out of stack");
+            if (decode_string(L, sc.pos, text_end - sc.pos, msg) < 0) {
+                lua_pushnil(L);
+                lua_pushstring(L, msg);
+                return 2;
+            }
+            if (++parts > 16) {
+                lua_concat(L, parts);
+                parts = 1;
+            }
+        }
+        if (lt == NULL)
+            break;
+        sc.pos = lt + 1;
+
+        if (sc.pos < sc.end && *sc.pos == '?') {
+            scan_past(&sc, "?>", 2);
+        } else if (sc.end - sc.pos >= 3 && memcmp(sc.pos, "!--", 3) == 0) {
+            scan_past(&sc, "-->", 3);
+        } else if (sc.end - sc.pos >= 8 && memcmp(sc.pos, "![CDATA[", 8) == 0) {
+            const char *start = sc.pos + 8;
+            sc.pos = start;
+            if (scan_past(&sc, "]]>", 3) && collect && depth == collect) {
+                luaL_checkstack(L, 2, "xml get out of stack");
+                lua_pushlstring(L, start, sc.pos - 3 - start);
+                parts++;
+            }
+        } else if (sc.pos < sc.end && *sc.pos == '!') {
+            scan_doctype(&sc);
+        } else if (sc.pos < sc.end && *sc.pos == '/') {
+            if (!scan_past(&sc, ">", 1))
+                break;
+            if (depth == 0) {
+                scan_error(&sc, "unexpected closing tag");
+                break;
+            }
+            if (collect && depth == collect) {
+                if (parts == 0)
+                    lua_pushliteral(L, "");
+                else
+                    lua_concat(L, parts);
+                return 1;
+            }
+            depth--;
+            if (matched > depth)
+                matched = depth;
+            if (depth == 0)
+                break;      /* the root element is closed */
+        } else {
+            xml_name name;
+            const char *attrs;
+            bool empty = false;
+            if (!scan_start_tag(&sc, &name, &attrs, &empty))
+                break;
+            if (depth == 0 && root_seen) {
+                scan_error(&sc, "more than one root element");
+                break;
+            }
+            root_seen = true;
+            /* nothing matches under another root */
+            if (depth == 0 && !name_matches(segs[0], name.str, name.len)) {
+                lua_pushnil(L);
+                return 1;
+            }
+
+            if (depth == matched && matched < segs.size() &&
+                name_matches(segs[matched], name.str, name.len)) {
+                matched++;
+                if (matched == segs.size()) {
+                    /* the first matching element decides */
+                    if (attr.str) {
+                        ret = scan_attribute(L, attrs, sc.pos - 1, attr, msg);
+                        if (ret < 0) {
+                            lua_pushnil(L);
+                            lua_pushstring(L, msg);
+                            return 2;
+                        }
+                        if (ret == 0)
+                            lua_pushnil(L);
+                        return 1;
+                    }
+                    if (empty) {
+                        lua_pushliteral(L, "");
+                        return 1;
+                    }
+                    collect = depth + 1;
+                }
+            }
+            if (!empty)
+                depth++;
+            else if (matched > depth)
+                matched = depth;
+            if (depth == 0)
+                break;      /* the root element is empty */
+        }
+    }
+
+    if (sc.what == NULL && (collect || depth > 0))
+        sc.what = "unexpected end of data";
+    if (sc.what)
+    {
+        MARK_ERROR(msg, "xml get", sc.what);
+        lua_pushnil(L);
+        lua_pushstring(L, msg);
+        return 2;
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+/* ============================CONFIGURATION================================ */
+
+/* apply the settings in the table at idx */
+static void context_configure(lua_State *L, int idx, xml_context *context)
+{
+    decode_cache *cache = &context->cache;
+
+    lua_getfield(L, idx, "decode_cache_shared");
+    if (!lua_isnil(L, -1)) {
+        luaL_argcheck(L, lua_isboolean(L, -1), idx,
+            "`decode_cache_shared' must be a boolean");
+        bool shared = lua_toboolean(L, -1);
+        if (shared != cache->shared) {
+            /* entries stored in the other mode can't be reused */
+            cache_evict(L, cache, 0);
+            cache->shared = shared;
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "decode_cache_size");
+    if (!lua_isnil(L, -1)) {
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TNUMBER &&
+            lua_tonumber(L, -1) >= 0, idx,
+            "`decode_cache_size' must be a non-negative number");
+        cache->capacity = lua_tonumber(L, -1);
+        cache_evict(L, cache, cache->capacity);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "encode_buffer_size");
+    if (!lua_isnil(L, -1)) {
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TNUMBER &&
+            lua_tonumber(L, -1) >= 0, idx,
+            "`encode_buffer_size' must be a non-negative number");
+        context->res_retain = lua_tonumber(L, -1);
+        /* a call in progress shrinks it when done */
+        if (!context->res_taken)
+            res_shrink(context);
+    }
+    lua_pop(L, 1);
+}
+
+int cfg(lua_State *L)
+{
+    xml_context *context = get_context(L);
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        context_configure(L, 1, context);
+    }
+
+    lua_createtable(L, 0, 3);
+    lua_pushnumber(L, context->cache.capacity);
+    lua_setfield(L, -2, "decode_cache_size");
+    lua_pushboolean(L, context->cache.shared);
+    lua_setfield(L, -2, "decode_cache_shared");
+    lua_pushnumber(L, context->res_retain);
+    lua_setfield(L, -2, "encode_buffer_size");
+    return 1;
+}
+
+int cache_stats(lua_State *L)
+{
+    decode_cache *cache = &get_context(L)->cache;
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, cache->hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, cache->misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushnumber(L, cache->evictions);
+    lua_setfield(L, -2, "evictions");
+    lua_pushnumber(L, cache->lru.size());
+    lua_setfield(L, -2, "entries");
+    lua_pushnumber(L, cache->size);
+    lua_setfield(L, -2, "size");
+    return 1;
+}
+
+#ifdef WITH_STATS
+static void set_number(lua_State *L, const char *key, double value)
+{
+    lua_pushnumber(L, value);
+    lua_setfield(L, -2, key);
+}
+
+static void set_histogram(lua_State *L, const char *key, const histogram *h)
+{
+    lua_createtable(L, 0, 3);
+    set_number(L, "count", h->count);
+    set_number(L, "sum", h->sum);
+    lua_createtable(L, STATS_BUCKETS, 0);
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        lua_pushnumber(L, h->buckets[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "buckets");
+    lua_setfield(L, -2, key);
+}
+#endif
+
+int stats(lua_State *L)
+{
+    xml_context *context = get_context(L);
+#ifdef WITH_STATS
+    const xml_stats *stats = &context->stats;
+    lua_createtable(L, 0, 4);
+
+    lua_createtable(L, 0, 6);
+    set_number(L, "calls", stats->decode_calls);
+    set_number(L, "bytes", stats->decode_bytes);
+    set_number(L, "elements", stats->elements);
+    set_number(L, "attributes", stats->attributes);
+    set_number(L, "strings", stats->strings);
+    lua_createtable(L, 0, DECODE_ERRORS);
+    set_number(L, "options", stats->decode_errors[DECODE_ERROR_OPTIONS]);
+    set_number(L, "invalid", stats->decode_errors[DECODE_ERROR_INVALID]);
+    set_number(L, "limit", stats->decode_errors[DECODE_ERROR_LIMIT]);
+    set_number(L, "cancelled", stats->decode_errors[DECODE_ERROR_CANCELLED]);
+    lua_setfield(L, -2, "errors");
+    lua_setfield(L, -2, "decode");
 
-    lua_pushlstring(L, res.c_str(), res.length());
+    lua_createtable(L, 0, 5);
+    set_number(L, "calls", stats->encode_calls);
+    set_number(L, "bytes", stats->encode_bytes);
+    set_number(L, "buffer", context->res.capacity());
+    set_number(L, "buffer_peak", stats->buffer_peak);
+    lua_createtable(L, 0, ENCODE_ERRORS);
+    set_number(L, "options", stats->encode_errors[ENCODE_ERROR_OPTIONS]);
+    set_number(L, "failed", stats->encode_errors[ENCODE_ERROR_FAILED]);
+    lua_setfield(L, -2, "errors");
+    lua_setfield(L, -2, "encode");
+
+    lua_createtable(L, 0, 2);
+    set_number(L, "peak", stats->pool_peak);
+    set_number(L, "blocks", stats->pool_blocks);
+    lua_setfield(L, -2, "pool");
+
+    lua_createtable(L, 0, 4);
+    set_histogram(L, "parse", &stats->parse);
+    set_histogram(L, "expand", &stats->expand);
+    set_histogram(L, "materialize", &stats->materialize);
+    set_histogram(L, "encode", &stats->encode);
+    lua_setfield(L, -2, "latency");
     return 1;
+#else
+    MARK_ERROR(context->msg, "xml stats", "disabled at build time");
+    lua_pushnil(L);
+    lua_pushstring(L, context->msg);
+    return 2;
+#endif
+}
+
+int reset_stats(lua_State *L)
+{
+#ifdef WITH_STATS
+    xml_context *context = get_context(L);
+    memset(&context->stats, 0, sizeof(context->stats));
+#else
+    (void)L;
+#endif
+    return 0;
 }
 
 /* ====================LIBRARY INITIALISATION FUNCTION======================= */
 
+/* functions of the module and of every context, bound to it by upvalue */
+static const struct luaL_Reg lib [] = {
+    {"encode", encode},
+    {"decode", decode},
+    {"patch", patch},
+    {"validate", validate},
+    {"get", get},
+    {"template", compile_template},
+    {"compile_encoder", compile_encoder},
+    {"freeze", freeze},
+    {"unfreeze", unfreeze},
+    {"cfg", cfg},
+    {"cache_stats", cache_stats},
+    {"stats", stats},
+    {"reset_stats", reset_stats},
+    {NULL, NULL}
+};
+
+#define CONTEXT_MT "luarapidxml.context"
+
+static int context_gc(lua_State *L)
+{
+    xml_context *context = (xml_context *)luaL_checkudata(L, 1, CONTEXT_MT);
+    cache_evict(L, &context->cache, 0);
+    luaL_unref(L, LUA_REGISTRYINDEX, context->decode_options);
+    luaL_unref(L, LUA_REGISTRYINDEX, context->encode_options);
+    context->~xml_context();
+    return 0;
+}
+
+int new_context(lua_State *L)
+{
+    lua_settop(L, 1);
+    if (!lua_isnil(L, 1))
+        luaL_checktype(L, 1, LUA_TTABLE);
+
+    xml_context *context = (xml_context *)lua_newuserdata(L, sizeof(xml_context));
+    new (context) xml_context();
+    if (luaL_newmetatable(L, CONTEXT_MT))
+    {
+        lua_pushcfunction(L, context_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    if (!lua_isnil(L, 1))
+    {
+        context_configure(L, 1, context);
+
+        /* copied, later changes to the tables don't apply */
+        static const char *const kinds[] = {"decode", "encode"};
+        static const char *const errors[] = {
+            "`decode' must be a table", "`encode' must be a table",
+        };
+        int *refs[] = {&context->decode_options, &context->encode_options};
+        for (int i = 0; i < 2; i++)
+        {
+            lua_getfield(L, 1, kinds[i]);
+            if (!lua_isnil(L, -1))
+            {
+                luaL_argcheck(L, lua_istable(L, -1), 1, errors[i]);
+                lua_newtable(L);
+                copy_fields(L, lua_gettop(L) - 1, lua_gettop(L));
+                *refs[i] = luaL_ref(L, LUA_REGISTRYINDEX);
+            }
+            lua_pop(L, 1);
+        }
+    }
+
+    luaL_newlibtable(L, lib);
+    lua_pushvalue(L, 2);
+    luaL_setfuncs(L, lib, 1);
+    return 1;
+}
+
 int luaopen_luarapidxml(lua_State *L)
 {
-    static const struct luaL_Reg lib [] = {
-        {"encode", encode},
-        {"decode", decode},
-        {NULL, NULL}
-    };
-    luaL_newlib(L, lib);
+    CTID_INT64 = luaL_ctypeid(L, "int64_t");
+    CTID_UINT64 = luaL_ctypeid(L, "uint64_t");
+    luaL_newlibtable(L, lib);
+    lua_pushlightuserdata(L, &default_context);
+    luaL_setfuncs(L, lib, 1);
+    lua_pushcfunction(L, new_context);
+    lua_setfield(L, -2, "new");
     return 1;
 }
@@ -279,6 +279,26 @@ namespace rapidxml
     //! See xml_document::parse() function.
     const int parse_full = parse_declaration_node | parse_comment_nodes | parse_doctype_node | parse_pi_nodes | parse_validate_closing_tags;
 
+    ///////////////////////////////////////////////////////////////////////
+    // Parsing limits
+
+    //! Limits checked by the parser, see xml_document::limits().
+    //! Zero means no limit. When a limit is exceeded, parsing fails with
+    //! "limit exceeded" error and exceeded is set to the name of the limit.
+    struct parse_limits
+    {
+        std::size_t max_depth;          //!< Nesting depth of elements, the root is at depth 1
+        std::size_t max_nodes;          //!< Number of nodes of any type, attributes not included
+        std::size_t max_attributes;     //!< Number of attributes of an element
+        std::size_t max_string;         //!< Length of a text, CDATA or attribute value, as written
+        bool (*expired)(void *data);    //!< If set, called every interval nodes, parsing stops when it returns true
+        void *data;                     //!< Passed to expired()
+        std::size_t interval;           //!< Nodes between expired() calls, must be set with it
+        const char *exceeded;           //!< Set by the parser to the name of the exceeded limit
+        std::size_t depth;              //!< Current depth, maintained by the parser
+        std::size_t nodes;              //!< Nodes parsed so far, maintained by the parser
+    };
+
     ///////////////////////////////////////////////////////////////////////
     // Internals
 
@@ -536,6 +556,22 @@ namespace rapidxml
             init();
         }
 
+        //! Returns the number of dynamically allocated blocks since the pool was cleared.
+        std::size_t dynamic_blocks() const
+        {
+            return m_blocks;
+        }
+
+        //! Returns the number of bytes the pool has taken since it was cleared:
+        //! the used part of static memory, or all of it if dynamic blocks were allocated,
+        //! plus the size of the dynamic blocks.
+        std::size_t allocated() const
+        {
+            if (m_blocks == 0)
+                return m_ptr - m_static_memory;
+            return sizeof(m_static_memory) + m_block_bytes;
+        }
+
         //! Sets or resets the user-defined memory allocation functions for the pool.
         //! This can only be called when no memory is allocated from the pool yet, otherwise results are undefined.
         //! Allocation function must not return invalid pointer on failure. It should either throw,
@@ -568,6 +604,8 @@ namespace rapidxml
             m_begin = m_static_memory;
             m_ptr = align(m_begin);
             m_end = m_static_memory + sizeof(m_static_memory);
+            m_blocks = 0;
+            m_block_bytes = 0;
         }
         
         char *align(char *ptr)
@@ -612,6 +650,8 @@ namespace rapidxml
                 // Allocate
                 std::size_t alloc_size = sizeof(header) + (2 * RAPIDXML_ALIGNMENT - 2) + pool_size;     // 2 alignments required in worst case: one for header, one for actual allocation
                 char *raw_memory = allocate_raw(alloc_size);
+                ++m_blocks;
+                m_block_bytes += alloc_size;
                     
                 // Setup new pool in allocated memory
                 char *pool = align(raw_memory);
@@ -636,6 +676,8 @@ namespace rapidxml
         char m_static_memory[RAPIDXML_STATIC_POOL_SIZE];    // Static raw memory
         alloc_func *m_alloc_func;                           // Allocator function, or 0 if default is to be used
         free_func *m_free_func;                             // Free function, or 0 if default is to be used
+        std::size_t m_blocks;                               // Dynamic blocks allocated since the pool was cleared
+        std::size_t m_block_bytes;                          // Total size of these blocks
     };
 
     ///////////////////////////////////////////////////////////////////////////
@@ -658,6 +700,7 @@ namespace rapidxml
             : m_name(0)
             , m_value(0)
             , m_parent(0)
+            , m_value_escaped(true)
         {
         }
 
@@ -702,6 +745,14 @@ namespace rapidxml
             return m_value ? m_value_size : 0;
         }
 
+        //! Tells whether value may contain character entity references that were not expanded.
+        //! Parser clears it for values without any '&' characters, so they can be used as is.
+        //! \return True if value has to be checked for entity references.
+        bool value_escaped() const
+        {
+            return m_value_escaped;
+        }
+
         ///////////////////////////////////////////////////////////////////////////
         // Node modification
     
@@ -762,6 +813,13 @@ namespace rapidxml
             this->value(value, internal::measure(value));
         }
 
+        //! Sets whether value may contain character entity references.
+        //! \param escaped False if value is known not to contain any.
+        void value_escaped(bool escaped)
+        {
+            m_value_escaped = escaped;
+        }
+
         ///////////////////////////////////////////////////////////////////////////
         // Related nodes access
     
@@ -786,6 +844,7 @@ namespace rapidxml
         std::size_t m_name_size;            // Length of node name, or undefined of no name
         std::size_t m_value_size;           // Length of node value, or undefined if no value
         xml_node<Ch> *m_parent;             // Pointer to parent node, or 0 if none
+        bool m_value_escaped;               // Value may contain unexpanded character entity references
 
     };
 
@@ -902,6 +961,7 @@ namespace rapidxml
             : m_type(type)
             , m_first_node(0)
             , m_first_attribute(0)
+            , m_source_end(0)
         {
         }
 
@@ -915,6 +975,24 @@ namespace rapidxml
             return m_type;
         }
 
+        //! Gets end of the node in the source text.
+        //! For elements produced by the parser, this points one past the '>' character
+        //! that closes either the closing tag or the empty-element tag.
+        //! Together with name() it gives the exact source span of the element.
+        //! \return Pointer past the end of node source, or 0 if not known.
+        Ch *source_end() const
+        {
+            return m_source_end;
+        }
+
+        //! Sets end of the node in the source text.
+        //! See also xml_node::source_end().
+        //! \param end Pointer past the end of node source.
+        void source_end(Ch *end)
+        {
+            m_source_end = end;
+        }
+
         ///////////////////////////////////////////////////////////////////////////
         // Related nodes access
     
@@ -1341,6 +1419,7 @@ namespace rapidxml
         xml_attribute<Ch> *m_last_attribute;    // Pointer to last attribute of node, or 0 if none; this value is only valid if m_first_attribute is non-zero
         xml_node<Ch> *m_prev_sibling;           // Pointer to previous sibling of node, or 0 if none; this value is only valid if m_parent is non-zero
         xml_node<Ch> *m_next_sibling;           // Pointer to next sibling of node, or 0 if none; this value is only valid if m_parent is non-zero
+        Ch *m_source_end;                       // Pointer past the end of node in the source text, or 0 if not known; always valid
 
     };
 
@@ -1363,7 +1442,16 @@ namespace rapidxml
         //! Constructs empty XML document
         xml_document()
             : xml_node<Ch>(node_document)
+            , m_limits(0)
+        {
+        }
+
+        //! Sets limits checked by subsequent parse() calls, or 0 for none.
+        //! The limits must persist while parsing.
+        //! \param limits Limits to check.
+        void limits(parse_limits *limits)
         {
+            m_limits = limits;
         }
 
         //! Parses zero-terminated XML string according to given flags.
@@ -1385,6 +1473,14 @@ namespace rapidxml
             // Remove current contents
             this->remove_all_nodes();
             this->remove_all_attributes();
+
+            // Reset limit counters
+            if (m_limits)
+            {
+                m_limits->exceeded = 0;
+                m_limits->depth = 0;
+                m_limits->nodes = 0;
+            }
             
             // Parse BOM, if any
             parse_bom<Flags>(text);
@@ -1421,6 +1517,36 @@ namespace rapidxml
         
     private:
 
+        parse_limits *m_limits;     // Limits checked while parsing, or 0 if none
+
+        ///////////////////////////////////////////////////////////////////////
+        // Limit checks
+
+        void limit_exceeded(const char *name, Ch *where)
+        {
+            m_limits->exceeded = name;
+            RAPIDXML_PARSE_ERROR("limit exceeded", where);
+        }
+
+        // Count a new node
+        void limit_node(Ch *where)
+        {
+            if (!m_limits)
+                return;
+            std::size_t nodes = ++m_limits->nodes;
+            if (m_limits->max_nodes && nodes > m_limits->max_nodes)
+                limit_exceeded("max_nodes", where);
+            if (m_limits->expired && nodes % m_limits->interval == 0 && m_limits->expired(m_limits->data))
+                limit_exceeded("timeout", where);
+        }
+
+        // Check the length of a value
+        void limit_string(std::size_t size, Ch *where)
+        {
+            if (m_limits && m_limits->max_string && size > m_limits->max_string)
+                limit_exceeded("max_string", where);
+        }
+
         ///////////////////////////////////////////////////////////////////////
         // Internal character utility functions
         
@@ -1566,17 +1692,23 @@ namespace rapidxml
         // Skip characters until predicate evaluates to true while doing the following:
         // - replacing XML character entity references with proper characters (&apos; &amp; &quot; &lt; &gt; &#...;)
         // - condensing whitespace sequences to single space character
+        // Sets escaped if entity references were left in the text.
         template<class StopPred, class StopPredPure, int Flags>
-        static Ch *skip_and_expand_character_refs(Ch *&text)
+        static Ch *skip_and_expand_character_refs(Ch *&text, bool &escaped)
         {
-            // If entity translation, whitespace condense and whitespace trimming is disabled, use plain skip
+            // If entity translation and whitespace condense is disabled, use plain skip
+            // (trimming is done by the caller and never modifies the text)
             if (Flags & parse_no_entity_translation && 
-                !(Flags & parse_normalize_whitespace) &&
-                !(Flags & parse_trim_whitespace))
+                !(Flags & parse_normalize_whitespace))
             {
-                skip<StopPred, Flags>(text);
+                // Pure skip stops at the first '&', if any
+                skip<StopPredPure, Flags>(text);
+                escaped = StopPred::test(*text) != 0;
+                if (escaped)
+                    skip<StopPred, Flags>(text);
                 return text;
             }
+            escaped = (Flags & parse_no_entity_translation) != 0;
             
             // Use simple skip until first modification is detected
             skip<StopPredPure, Flags>(text);
@@ -1945,10 +2077,11 @@ namespace rapidxml
             
             // Skip until end of data
             Ch *value = text, *end;
+            bool escaped;
             if (Flags & parse_normalize_whitespace)
-                end = skip_and_expand_character_refs<text_pred, text_pure_with_ws_pred, Flags>(text);   
+                end = skip_and_expand_character_refs<text_pred, text_pure_with_ws_pred, Flags>(text, escaped);   
             else
-                end = skip_and_expand_character_refs<text_pred, text_pure_no_ws_pred, Flags>(text);
+                end = skip_and_expand_character_refs<text_pred, text_pure_no_ws_pred, Flags>(text, escaped);
 
             // Trim trailing whitespace if flag is set; leading was already trimmed by whitespace skip after >
             if (Flags & parse_trim_whitespace)
@@ -1967,12 +2100,16 @@ namespace rapidxml
                 }
             }
             
+            limit_node(value);
+            limit_string(end - value, value);
+
             // If characters are still left between end and value (this test is only necessary if normalization is enabled)
             // Create new data node
             if (!(Flags & parse_no_data_nodes))
             {
                 xml_node<Ch> *data = this->allocate_node(node_data);
                 data->value(value, end - value);
+                data->value_escaped(escaped);
                 node->append_node(data);
             }
 
@@ -2020,6 +2157,8 @@ namespace rapidxml
                 ++text;
             }
 
+            limit_string(text - value, value);
+
             // Create new cdata node
             xml_node<Ch> *cdata = this->allocate_node(node_cdata);
             cdata->value(value, text - value);
@@ -2032,10 +2171,14 @@ namespace rapidxml
             return cdata;
         }
         
-        // Parse element node
+        // Parse start tag of element node, open is set if the element has contents
         template<int Flags>
-        xml_node<Ch> *parse_element(Ch *&text)
+        xml_node<Ch> *parse_start_tag(Ch *&text, bool &open)
         {
+            // Depth counts the elements open around this one
+            if (m_limits && m_limits->max_depth && m_limits->depth >= m_limits->max_depth)
+                limit_exceeded("max_depth", text);
+
             // Create element node
             xml_node<Ch> *element = this->allocate_node(node_element);
 
@@ -2056,7 +2199,10 @@ namespace rapidxml
             if (*text == Ch('>'))
             {
                 ++text;
-                parse_node_contents<Flags>(text, element);
+                if (m_limits)
+                    ++m_limits->depth;
+                open = true;
+                return element;
             }
             else if (*text == Ch('/'))
             {
@@ -2068,11 +2214,31 @@ namespace rapidxml
             else
                 RAPIDXML_PARSE_ERROR("expected >", text);
 
+            end_element<Flags>(text, element);
+            open = false;
+            return element;
+        }
+
+        // Finish element node after its end
+        template<int Flags>
+        void end_element(Ch *text, xml_node<Ch> *element)
+        {
+            // Remember where element source ends
+            element->source_end(text);
+
             // Place zero terminator after name
             if (!(Flags & parse_no_string_terminators))
                 element->name()[element->name_size()] = Ch('\0');
+        }
 
-            // Return parsed element
+        // Parse element node
+        template<int Flags>
+        xml_node<Ch> *parse_element(Ch *&text)
+        {
+            bool open;
+            xml_node<Ch> *element = parse_start_tag<Flags>(text, open);
+            if (open)
+                parse_node_contents<Flags>(text, element);
             return element;
         }
 
@@ -2080,6 +2246,8 @@ namespace rapidxml
         template<int Flags>
         xml_node<Ch> *parse_node(Ch *&text)
         {
+            limit_node(text);
+
             // Parse proper node type
             switch (text[0])
             {
@@ -2163,9 +2331,14 @@ namespace rapidxml
         }
 
         // Parse contents of the node - children, data etc.
+        // Nested elements are parsed in the same loop, going down to a child
+        // on its start tag and back up to the parent on its closing tag,
+        // so the depth of the document does not grow the C stack.
         template<int Flags>
-        void parse_node_contents(Ch *&text, xml_node<Ch> *node)
+        void parse_node_contents(Ch *&text, xml_node<Ch> *top)
         {
+            xml_node<Ch> *node = top;
+
             // For all children and text
             while (1)
             {
@@ -2208,11 +2381,29 @@ namespace rapidxml
                         if (*text != Ch('>'))
                             RAPIDXML_PARSE_ERROR("expected >", text);
                         ++text;     // Skip '>'
-                        return;     // Node closed, finished parsing contents
+
+                        // Node closed, go back to its parent
+                        if (m_limits)
+                            --m_limits->depth;
+                        end_element<Flags>(text, node);
+                        if (node == top)
+                            return;     // Finished parsing contents
+                        node = node->parent();
+                    }
+                    else if (text[1] != Ch('?') && text[1] != Ch('!'))
+                    {
+                        // Child element
+                        ++text;     // Skip '<'
+                        limit_node(text);
+                        bool open;
+                        xml_node<Ch> *child = parse_start_tag<Flags>(text, open);
+                        node->append_node(child);
+                        if (open)
+                            node = child;   // Continue with its contents
                     }
                     else
                     {
-                        // Child node
+                        // Other child node
                         ++text;     // Skip '<'
                         if (xml_node<Ch> *child = parse_node<Flags>(text))
                             node->append_node(child);
@@ -2236,9 +2427,14 @@ namespace rapidxml
         template<int Flags>
         void parse_node_attributes(Ch *&text, xml_node<Ch> *node)
         {
+            std::size_t count = 0;
+
             // For all attributes 
             while (attribute_name_pred::test(*text))
             {
+                if (m_limits && m_limits->max_attributes && ++count > m_limits->max_attributes)
+                    limit_exceeded("max_attributes", text);
+
                 // Extract attribute name
                 Ch *name = text;
                 ++text;     // Skip first character of attribute name
@@ -2274,14 +2470,17 @@ namespace rapidxml
 
                 // Extract attribute value and expand char refs in it
                 Ch *value = text, *end;
+                bool escaped;
                 const int AttFlags = Flags & ~parse_normalize_whitespace;   // No whitespace normalization in attributes
                 if (quote == Ch('\''))
-                    end = skip_and_expand_character_refs<attribute_value_pred<Ch('\'')>, attribute_value_pure_pred<Ch('\'')>, AttFlags>(text);
+                    end = skip_and_expand_character_refs<attribute_value_pred<Ch('\'')>, attribute_value_pure_pred<Ch('\'')>, AttFlags>(text, escaped);
                 else
-                    end = skip_and_expand_character_refs<attribute_value_pred<Ch('"')>, attribute_value_pure_pred<Ch('"')>, AttFlags>(text);
+                    end = skip_and_expand_character_refs<attribute_value_pred<Ch('"')>, attribute_value_pure_pred<Ch('"')>, AttFlags>(text, escaped);
                 
                 // Set attribute value
+                limit_string(end - value, value);
                 attribute->value(value, end - value);
+                attribute->value_escaped(escaped);
                 
                 // Make sure that end quote is present
                 if (*text != quote)
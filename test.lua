@@ -59,7 +59,7 @@ local nestedtag_lom = {
 }
 
 local test = tap.test("luarapidxml")
-test:plan(15)
+test:plan(38)
 
 ---------------------------------
 test:diag("Test decoding errors")
@@ -109,17 +109,17 @@ test:is_deeply(
 test:is_deeply(
     {pcall(encode, {tag = 'x', attr = {'y'}})},
     {true, nil, "encode element: Invalid table format" ..
-        " (`attr' table must have string keys and values)"},
+        " (`attr' table must have string keys and scalar values)"},
     "encode invalid attr (numeric key)"
 )
 test:is_deeply(
-    {pcall(encode, {tag = 'x', attr = {y = 0}})},
+    {pcall(encode, {tag = 'x', attr = {y = {}}})},
     {true, nil, "encode element: Invalid table format" ..
-        " (`attr' table must have string keys and values)"},
-    "encode invalid attr (numeric value)"
+        " (`attr' table must have string keys and scalar values)"},
+    "encode invalid attr (table value)"
 )
 test:is_deeply(
-    {pcall(encode, {tag = 'x', 0ULL})},
+    {pcall(encode, {tag = 'x', require('ffi').new('char[1]')})},
     {true, nil, "encode element: Invalid table format" ..
         " (unknown content type)"},
     "encode invalid conent (cdata)"
@@ -152,6 +152,1005 @@ test:is(
     "encode 'nestedtag'"
 )
 
+------------------------------
+test:diag("Test decode cache")
+
+test:test("decode cache", function(test)
+    test:plan(9)
+    local doc = '<heartbeat seq="1"><status>ok</status></heartbeat>'
+    local lom = {tag = "heartbeat", attr = {seq = "1"}, {tag = "status", "ok"}}
+
+    luarapidxml.cfg({decode_cache_size = 1024*1024})
+    local first = decode(doc)
+    local second = decode(doc)
+    test:is_deeply(second, lom, "cached result")
+    test:isnt(first, second, "copy returned by default")
+    second[1][1] = "modified"
+    test:is_deeply(decode(doc), lom, "copy doesn't affect the cache")
+    test:is_deeply(
+        luarapidxml.cache_stats(),
+        {hits = 2, misses = 1, evictions = 0, entries = 1,
+         size = luarapidxml.cache_stats().size},
+        "hit/miss counters"
+    )
+
+    luarapidxml.cfg({decode_cache_shared = true})
+    test:is(luarapidxml.cache_stats().entries, 0, "mode change flushes cache")
+    local shared = decode(doc)
+    test:is(decode(doc), shared, "shared result")
+    test:is_deeply(shared, lom, "shared result content")
+
+    luarapidxml.cfg({decode_cache_size = 1})
+    test:is(luarapidxml.cache_stats().entries, 0, "shrinking evicts")
+
+    luarapidxml.cfg({decode_cache_size = 0, decode_cache_shared = false})
+    decode(doc)
+    test:is(luarapidxml.cache_stats().entries, 0, "disabled cache")
+end)
+
+------------------------------
+test:diag("Test raw subtrees")
+
+test:test("raw subtrees", function(test)
+    test:plan(4)
+    local body = '<soap:Body>\n  <op a = "1">&amp;<x/></op>\n</soap:Body >'
+    local envelope =
+        '<soap:Envelope xmlns:soap="urn:soap">' ..
+            '<soap:Header><To>svc</To></soap:Header>' ..
+            body ..
+        '</soap:Envelope>'
+
+    test:is_deeply(
+        decode(envelope, {raw = {"Body"}}),
+        {
+            tag = "soap:Envelope",
+            attr = {["xmlns:soap"] = "urn:soap"},
+            {tag = "soap:Header", {tag = "To", "svc"}},
+            body,
+        },
+        "raw element by local name"
+    )
+    test:is(
+        decode(envelope, {raw = {"soap:Envelope"}}),
+        envelope,
+        "raw root element"
+    )
+    test:is_deeply(
+        decode('<a><b/><c>x</c></a>', {raw = {"b"}}),
+        {tag = "a", "<b/>", {tag = "c", "x"}},
+        "raw empty element"
+    )
+    test:is_deeply(
+        {decode('<a/>', {raw = "b"})},
+        {nil, "xml decode: `raw' option must be an array of strings"},
+        "invalid raw option"
+    )
+end)
+
+--------------------------
+test:diag("Test patching")
+
+test:test("patch", function(test)
+    test:plan(11)
+    local doc =
+        '<ns:Envelope>\n' ..
+        '  <Header route="a" ttl = "5"><To>svc</To></Header>\n' ..
+        '  <Body><Order id="1"/><Secret>x</Secret></Body>\n' ..
+        '</ns:Envelope>'
+    local patch = luarapidxml.patch
+
+    test:is(
+        patch(doc, {{path = "Envelope/Header/To", set = "svc & co"}}),
+        (doc:gsub('>svc<', '>svc &amp; co<')),
+        "replace text"
+    )
+    test:is(
+        patch(doc, {{path = "Envelope/Body/Order", set = 42}}),
+        (doc:gsub('<Order id="1"/>', '<Order id="1">42</Order>')),
+        "set text of an empty element"
+    )
+    test:is(
+        patch(doc, {
+            {path = "Envelope/Header/@route", set = "<b>"},
+            {path = "Envelope/Header/@trace", set = "t1"},
+            {path = "Envelope/Header/@ttl", remove = true},
+        }),
+        (doc:gsub('<Header route="a" ttl = "5">',
+            '<Header route="&lt;b&gt;" trace="t1">')),
+        "edit attributes"
+    )
+    test:is(
+        patch(doc, {{path = "Envelope/Body/Secret", remove = true}}),
+        (doc:gsub('<Secret>x</Secret>', '')),
+        "remove element"
+    )
+    test:is(
+        patch(doc, {
+            {path = "Envelope/Header/@route", set = true},
+            {path = "Envelope/Header/To", set = 18446744073709551615ULL},
+        }),
+        (doc:gsub('route="a"', 'route="true"'):gsub('>svc<', '>18446744073709551615<')),
+        "booleans and 64-bit integers"
+    )
+    test:is_deeply(
+        {patch(doc, {{path = "Envelope/Header/To", set = {}}})},
+        {nil, "xml patch: `set' value must be a string, a number, a boolean or a 64-bit integer"},
+        "invalid value"
+    )
+    test:is(patch(doc, {}), doc, "no operations")
+    test:is_deeply(
+        {patch(doc, {{path = "Envelope/Body/Missing", set = "x"}})},
+        {nil, "xml patch: element not found: Envelope/Body/Missing"},
+        "missing element"
+    )
+    test:is_deeply(
+        {patch(doc, {
+            {path = "Envelope/Body", remove = true},
+            {path = "Envelope/Body/Order/@id", set = "2"},
+        })},
+        {nil, "xml patch: operations affect overlapping parts of the document"},
+        "overlapping operations"
+    )
+    test:is_deeply(
+        {patch(doc, {{path = "Envelope/Body", set = "x", remove = true}})},
+        {nil, "xml patch: operation must have either `set' or `remove' field"},
+        "ambiguous operation"
+    )
+    test:is_deeply(
+        {patch("<a>", {})},
+        {nil, "invalid xml string: unexpected end of data"},
+        "invalid document"
+    )
+end)
+
+-------------------------------
+test:diag("Test raw fragments")
+
+test:test("raw fragments", function(test)
+    test:plan(9)
+    local signature = '<ds:Signature><ds:Value>a&amp;b</ds:Value></ds:Signature>'
+    local lom = {tag = "Header", {tag = "To", "svc"}, {raw = signature}}
+
+    test:is(
+        encode(lom),
+        '<Header><To>svc</To>' .. signature .. '</Header>',
+        "raw fragment appended verbatim"
+    )
+    test:is(encode({raw = signature}), signature, "raw root")
+    test:is(
+        encode(lom, {validate_raw = true}),
+        '<Header><To>svc</To>' .. signature .. '</Header>',
+        "valid raw fragment"
+    )
+    test:is_deeply(
+        {encode({tag = "x", {raw = "<a>"}}, {validate_raw = true})},
+        {nil, "encode element: invalid raw fragment: unexpected end of data"},
+        "invalid raw fragment"
+    )
+    test:is_deeply(
+        {encode({tag = "x", {raw = "<a></b>"}}, {validate_raw = true})},
+        {nil, "encode element: invalid raw fragment: invalid closing tag name"},
+        "raw fragment with a mismatched closing tag"
+    )
+    test:is_deeply(
+        {encode({tag = "x", {raw = "<a>&bogus;</a>"}}, {validate_raw = true})},
+        {nil, "encode element: invalid raw fragment: invalid escape sequence"},
+        "raw fragment with an invalid entity"
+    )
+    test:is_deeply(
+        {encode({tag = "x", {raw = "<a/>\0<zz"}}, {validate_raw = true})},
+        {nil, "encode element: invalid raw fragment: unexpected zero byte"},
+        "raw fragment with a zero byte"
+    )
+    test:is(
+        encode({tag = "x", {raw = "<a/><b c='&#x41;'/>"}}, {validate_raw = true}),
+        "<x><a/><b c='&#x41;'/></x>",
+        "several raw elements"
+    )
+    test:is_deeply(
+        {encode({tag = "x", {raw = 1}})},
+        {nil, "encode element: Invalid table format" ..
+            " (`tag' field must be a string)"},
+        "raw fragment must be a string"
+    )
+end)
+
+---------------------------
+test:diag("Test templates")
+
+test:test("templates", function(test)
+    test:plan(7)
+    local tmpl = luarapidxml.template(
+        '<Envelope id="${id}"><Body>' ..
+            '<Amount cur="${cur}">${amount}</Amount>' ..
+            '<Note>${note} and ${note}</Note>' ..
+            '<![CDATA[${literal}]]>' ..
+        '</Body></Envelope>'
+    )
+    test:is(
+        tmpl:render({id = 7, cur = "EUR", amount = 1.5, note = "<&>"}),
+        '<Envelope id="7"><Body>' ..
+            '<Amount cur="EUR">1.5</Amount>' ..
+            '<Note>&lt;&amp;&gt; and &lt;&amp;&gt;</Note>' ..
+            '<![CDATA[${literal}]]>' ..
+        '</Body></Envelope>',
+        "render string template"
+    )
+    test:is(
+        tmpl:render({id = '"q"', cur = "", amount = 0, note = ""}),
+        '<Envelope id="&quot;q&quot;"><Body>' ..
+            '<Amount cur="">0</Amount>' ..
+            '<Note> and </Note>' ..
+            '<![CDATA[${literal}]]>' ..
+        '</Body></Envelope>',
+        "render again"
+    )
+    test:is_deeply(
+        {tmpl:render({id = 1, cur = "EUR", amount = 1})},
+        {nil, "xml template: missing value for placeholder: note"},
+        "missing value"
+    )
+
+    local lom_tmpl = luarapidxml.template({
+        tag = "Order", attr = {id = "${id}"}, {tag = "Item", "${item}"},
+    })
+    test:is(
+        lom_tmpl:render({id = 1, item = "book"}),
+        '<Order id="1"><Item>book</Item></Order>',
+        "render LOM template"
+    )
+    test:is(
+        luarapidxml.template('<a>${not closed</a>'):render({}),
+        '<a>${not closed</a>',
+        "no placeholders"
+    )
+    test:is_deeply(
+        {luarapidxml.template('<a>${x}</b')},
+        {nil, "invalid xml string: expected >"},
+        "invalid template"
+    )
+
+    local inner = luarapidxml.template('<i>${x}</i>')
+    test:is(
+        luarapidxml.template('<o>${a}${b}</o>'):render(setmetatable({a = 1}, {
+            __index = function() return inner:render({x = 2}) end,
+        })),
+        '<o>1&lt;i&gt;2&lt;/i&gt;</o>',
+        "render called from a metamethod"
+    )
+end)
+
+-----------------------------------
+test:diag("Test compiled encoders")
+
+test:test("compiled encoders", function(test)
+    test:plan(7)
+    local item = {
+        tag = "item",
+        attr = {{field = "sku", name = "SKU"}},
+        text = "title",
+    }
+    local encode_order = luarapidxml.compile_encoder({
+        tag = "order",
+        attr = {"id", "paid"},
+        children = {
+            "name",
+            {tag = "customer", children = {"email"}},
+            {tag = "items", field = "items", children = {
+                {tag = "item", field = "list", list = true,
+                 attr = item.attr, text = item.text},
+            }},
+            {tag = "tag", field = "tags", list = true},
+        },
+    })
+
+    test:is(
+        encode_order({
+            id = 1, paid = true, name = "A & B",
+            customer = {email = "a@b"},
+            items = {list = {{sku = "x1", title = "<book>"}, {sku = "x2"}}},
+            tags = {"new", 2},
+        }),
+        '<order id="1" paid="true"><name>A &amp; B</name>' ..
+            '<customer><email>a@b</email></customer>' ..
+            '<items><item SKU="x1">&lt;book&gt;</item><item SKU="x2"/></items>' ..
+            '<tag>new</tag><tag>2</tag>' ..
+        '</order>',
+        "encode record"
+    )
+    test:is(encode_order({}), '<order/>', "missing fields are omitted")
+    test:is(
+        encode_order:encode({customer = {}}),
+        '<order><customer/></order>',
+        "encode method"
+    )
+    test:is_deeply(
+        {encode_order({paid = {}})},
+        {nil, "record encode: unsupported field value type"},
+        "invalid field value"
+    )
+
+    local tree = {tag = "node", attr = {"name"}}
+    tree.children = {{tag = "node", field = "nodes", list = true, attr = tree.attr,
+        children = tree.children}}
+    tree.children[1].children = tree.children
+    local encode_tree = luarapidxml.compile_encoder(tree)
+    test:is(
+        encode_tree({name = "a", nodes = {{name = "b", nodes = {{name = "c"}}}}}),
+        '<node name="a"><node name="b"><node name="c"/></node></node>',
+        "recursive schema"
+    )
+    test:is_deeply(
+        {luarapidxml.compile_encoder({attr = {"id"}})},
+        {nil, "compile encoder: `tag' field must be a string"},
+        "invalid schema"
+    )
+
+    local encode_name = luarapidxml.compile_encoder({tag = "p", children = {"name"}})
+    test:is(
+        encode_name(setmetatable({}, {
+            __index = function() return encode({tag = "b"}) end,
+        })),
+        '<p><name>&lt;b/&gt;</name></p>',
+        "encode() called from a metamethod"
+    )
+end)
+
+-----------------------------------
+test:diag("Test streaming encoder")
+
+test:test("streaming encoder", function(test)
+    test:plan(8)
+    local big = string.rep("x", 100)
+    local lom = {tag = "rows"}
+    for i = 1, 50 do
+        table.insert(lom, {tag = "row", attr = {n = tostring(i)}, "<" .. i .. ">"})
+    end
+    table.insert(lom, {tag = "blob", big})
+    local expected = encode(lom)
+
+    local chunks = {}
+    local n = encode(lom, {chunk_size = 64, writer = function(chunk)
+        table.insert(chunks, chunk)
+    end})
+    test:is(n, #expected, "bytes written")
+    test:is(table.concat(chunks), expected, "chunks make up the document")
+    local max = 0
+    for _, chunk in ipairs(chunks) do
+        max = math.max(max, #chunk)
+    end
+    test:ok(#chunks > 10 and max < 200, "output is chunked")
+    local passed = false
+    for _, chunk in ipairs(chunks) do
+        passed = passed or chunk == big
+    end
+    test:ok(passed, "large plain text passed through")
+
+    local sink = {parts = {}}
+    function sink:write(data)
+        table.insert(self.parts, data)
+        return #data
+    end
+    encode(lom, {writer = sink})
+    test:is(table.concat(sink.parts), expected, "writer object")
+
+    local broken = {write = function() return nil, "connection reset" end}
+    test:is_deeply(
+        {encode(lom, {writer = broken})},
+        {nil, "xml encode: writer failed: connection reset"},
+        "writer object failure"
+    )
+    local ok, res, err = pcall(encode, lom, {writer = function() error("boom", 0) end})
+    test:is_deeply({ok, res, err}, {true, nil, "xml encode: writer failed: boom"},
+        "writer function failure")
+    test:is_deeply(
+        {encode(lom, {writer = 1})},
+        {nil, "xml encode: `writer' must be a function or have write() method"},
+        "invalid writer"
+    )
+end)
+
+-------------------------------
+test:diag("Test lazy children")
+
+test:test("lazy children", function(test)
+    test:plan(7)
+    local function counter(n)
+        local i = 0
+        return function()
+            i = i + 1
+            if i <= n then
+                return {tag = "row", i}
+            end
+        end
+    end
+
+    test:is(
+        encode({tag = "rows", counter(3)}),
+        '<rows><row>1</row><row>2</row><row>3</row></rows>',
+        "function generator"
+    )
+    test:is(
+        encode({tag = "rows", "head", counter(0), counter(1), "tail"}),
+        '<rows>head<row>1</row>tail</rows>',
+        "mixed content"
+    )
+
+    -- the shape of luafun iterators, e.g. box.space.x:pairs():map(...)
+    local iter = setmetatable({
+        gen = function(param, state)
+            if state < param then
+                return state + 1, {tag = "n", state + 1}
+            end
+        end,
+        param = 2,
+        state = 0,
+    }, {__call = function() error("must not be called") end})
+    test:is(
+        encode({tag = "list", iter}),
+        '<list><n>1</n><n>2</n></list>',
+        "luafun iterator"
+    )
+
+    local callable = setmetatable({}, {__call = counter(2)})
+    test:is(
+        encode({tag = "rows", callable}),
+        '<rows><row>1</row><row>2</row></rows>',
+        "callable table"
+    )
+    test:is(
+        encode({tag = "rows", function() return nil end}),
+        '<rows></rows>',
+        "empty generator"
+    )
+    test:is_deeply(
+        {encode({tag = "rows", function() error("no more rows", 0) end})},
+        {nil, "xml encode: generator failed: no more rows"},
+        "generator failure"
+    )
+
+    local rows = counter(2)
+    test:is(
+        encode({tag = "rows", "head", function()
+            local row = rows()
+            return row and {raw = encode(row)}
+        end, "tail"}),
+        '<rows>head<row>1</row><row>2</row>tail</rows>',
+        "encode() called from a generator"
+    )
+end)
+
+--------------------------------
+test:diag("Test output buffers")
+
+test:test("output buffers", function(test)
+    test:plan(7)
+    local lom = {tag = "root", attr = {id = "1"}}
+    for i = 1, 1000 do
+        table.insert(lom, {tag = "item", attr = {n = tostring(i)}, "a < b"})
+    end
+    local xml = encode(lom)
+
+    test:is(encode(lom, {estimate = true}), xml, "estimated buffer size")
+
+    local saved = luarapidxml.cfg().encode_buffer_size
+    test:is(luarapidxml.cfg({encode_buffer_size = 0}).encode_buffer_size, 0,
+        "buffer size is configured")
+    test:is(encode(lom), xml, "buffer released after encoding")
+    luarapidxml.cfg({encode_buffer_size = saved})
+
+    local buffer = require('buffer')
+    local ffi = require('ffi')
+    local ibuf = buffer.ibuf()
+    local len, err = encode({tag = "a"}, {ibuf = ibuf})
+    if err ~= nil and err:match("not supported") then
+        for _ = 1, 4 do
+            test:skip("ibuf is not supported by this Tarantool version")
+        end
+        return
+    end
+    test:is(len, 4, "bytes appended to ibuf")
+    test:is(encode(lom, {ibuf = ibuf, chunk_size = 1000, estimate = true}), #xml,
+        "document appended to ibuf")
+    test:is(ffi.string(ibuf.rpos, ibuf:size()), '<a/>' .. xml, "ibuf content")
+    test:is_deeply(
+        {encode(lom, {ibuf = ibuf, writer = function() end})},
+        {nil, "xml encode: `ibuf' and `writer' can't be used together"},
+        "ibuf with writer"
+    )
+end)
+
+---------------------------------
+test:diag("Test frozen subtrees")
+
+test:test("frozen subtrees", function(test)
+    test:plan(6)
+    local header = {tag = "header", {tag = "token", "a&b"}}
+    test:is(luarapidxml.freeze(header), header, "freeze returns the table")
+
+    local msg = {tag = "msg", header, {tag = "body", "1"}}
+    local xml = '<msg><header><token>a&amp;b</token></header><body>1</body></msg>'
+    test:is(encode(msg), xml, "first encoding")
+    test:is(encode(msg), xml, "encoding reuses serialized bytes")
+
+    -- changes are not seen until the table is unfrozen
+    header[1][1] = "c"
+    test:is(encode(msg), xml, "stale bytes of a frozen table")
+    luarapidxml.unfreeze(header)
+    test:is(encode(msg),
+        '<msg><header><token>c</token></header><body>1</body></msg>',
+        "unfrozen table is encoded again")
+
+    local big = {tag = "big"}
+    for i = 1, 100 do
+        table.insert(big, {tag = "item", tostring(i)})
+    end
+    luarapidxml.freeze(big)
+    local expected = encode({tag = "root", big, big})
+    local chunks = {}
+    encode({tag = "root", big, big}, {
+        chunk_size = 64,
+        writer = function(chunk) table.insert(chunks, chunk) end,
+    })
+    test:is(table.concat(chunks), expected, "frozen subtree in streaming mode")
+end)
+
+-------------------------------
+test:diag("Test scalar values")
+
+test:test("scalar values", function(test)
+    test:plan(6)
+    local numbers = {0, -0, 1, -1, 42, 1e13, 99999999999999, 1e14, -1e15,
+        0.1, -2.5, 1/3, 1e-7, 2^53, 2^63, 1/0, -1/0, 0/0, -(0/0)}
+    local ok = true
+    for _, n in ipairs(numbers) do
+        if encode({tag = "n", n}) ~= "<n>" .. tostring(n) .. "</n>" then
+            ok = false
+            test:diag("number " .. tostring(n) .. ": " .. encode({tag = "n", n}))
+        end
+    end
+    test:ok(ok, "numbers are formatted as tostring() does")
+
+    test:is(
+        encode({tag = "x", attr = {v = 0/0}, 0/0}),
+        '<x v="nan">nan</x>',
+        "NaN is spelled as tostring() does"
+    )
+    test:is(
+        encode({tag = "x", attr = {n = 1.5}, true, false}),
+        '<x n="1.5">truefalse</x>',
+        "numbers and booleans"
+    )
+    test:is(
+        encode({tag = "x", attr = {id = 18446744073709551615ULL},
+            -9223372036854775807LL - 1}),
+        '<x id="18446744073709551615">-9223372036854775808</x>',
+        "64-bit integers"
+    )
+    test:is(
+        luarapidxml.template('<x a="${a}">${b}</x>'):render({a = true, b = 7ULL}),
+        '<x a="true">7</x>',
+        "template values"
+    )
+    test:is_deeply(
+        {encode({tag = "x", attr = {n = function() end}})},
+        {nil, "encode element: Invalid table format" ..
+            " (`attr' table must have string keys and scalar values)"},
+        "unsupported attribute value"
+    )
+end)
+
+-------------------------------
+test:diag("Test parse options")
+
+test:test("parse options", function(test)
+    test:plan(7)
+    test:is_deeply(
+        decode('<a>  x  <b/>\n  </a>', {trim_whitespace = true}),
+        {tag = "a", "x", {tag = "b"}},
+        "trim whitespace"
+    )
+    test:is_deeply(
+        decode('<a> x \n\t y </a>', {normalize_whitespace = true}),
+        {tag = "a", " x y "},
+        "normalize whitespace"
+    )
+    test:is_deeply(
+        decode('<a> x \n\t y </a>', {normalize_whitespace = true,
+            trim_whitespace = true}),
+        {tag = "a", "x y"},
+        "normalize and trim whitespace"
+    )
+    test:is_deeply(decode('<a></b>'), {tag = "a"},
+        "closing tags are not validated by default")
+    test:is_deeply(
+        {decode('<a></b>', {validate_closing_tags = true})},
+        {nil, "invalid xml string: invalid closing tag name"},
+        "validate closing tags"
+    )
+
+    local xml = '<a t="&lt;&#x41;&quot;">&amp;&#169;<b>&apos;&#x1F60E;</b></a>'
+    test:is_deeply(decode(xml, {translate_entities = true}), decode(xml),
+        "translate entities")
+    test:is_deeply(
+        decode('<a><b x="&amp;">&lt;</b>&amp;</a>',
+            {translate_entities = true, raw = {"b"}}),
+        {tag = "a", '<b x="&amp;">&lt;</b>', "&"},
+        "raw subtrees of a translated document"
+    )
+end)
+
+----------------------------------
+test:diag("Test blank text nodes")
+
+test:test("blank text nodes", function(test)
+    test:plan(3)
+    -- whitespace before a tag never makes a text node
+    local xml = '<list>\n  <item> a b </item>\r\n\t<item>  </item>\n</list>'
+    test:is_deeply(
+        decode(xml),
+        {tag = "list", {tag = "item", " a b "}, {tag = "item"}},
+        "indentation is not decoded"
+    )
+    test:is_deeply(
+        decode(xml, {trim_whitespace = true}),
+        {tag = "list", {tag = "item", "a b"}, {tag = "item"}},
+        "other text is trimmed"
+    )
+    test:is_deeply(
+        decode('<a>x <b/> <![CDATA[ ]]></a>'),
+        {tag = "a", "x ", {tag = "b"}, " "},
+        "mixed content and CDATA are kept"
+    )
+end)
+
+------------------------------------------
+test:diag("Test clean and escaped values")
+
+test:test("clean and escaped values", function(test)
+    test:plan(2)
+    test:is_deeply(
+        decode('<a x="plain" y="a&amp;b" z=\'&quot;\'>text<b>&lt;</b>tail &amp;</a>'),
+        {tag = "a", attr = {x = "plain", y = "a&b", z = '"'},
+            "text", {tag = "b", "<"}, "tail &"},
+        "values with and without entities"
+    )
+    test:is_deeply(
+        {decode('<a>x &bad; y</a>')},
+        {nil, "xml decode: invalid escape sequence"},
+        "escaped values are still checked"
+    )
+end)
+
+--------------------------------
+test:diag("Test decode filters")
+
+test:test("decode filters", function(test)
+    test:plan(7)
+    local xml = '<soap:Envelope xmlns:soap="urn:s">' ..
+        '<soap:Header><Auth user="u"/><Signature>AAAA</Signature></soap:Header>' ..
+        '<soap:Body><Order id="1"><Item>x</Item></Order>' ..
+        '<Attachment>BBBB</Attachment>text</soap:Body>' ..
+        '</soap:Envelope>'
+
+    test:is_deeply(
+        decode(xml, {skip = {"Signature", "Attachment"}}),
+        {tag = "soap:Envelope", attr = {["xmlns:soap"] = "urn:s"},
+            {tag = "soap:Header", {tag = "Auth", attr = {user = "u"}}},
+            {tag = "soap:Body", {tag = "Order", attr = {id = "1"},
+                {tag = "Item", "x"}}, "text"}},
+        "skip subtrees"
+    )
+    test:is_deeply(
+        decode(xml, {only = {"Header", "Body/Order"}}),
+        {tag = "soap:Envelope",
+            {tag = "soap:Header", {tag = "Auth", attr = {user = "u"}},
+                {tag = "Signature", "AAAA"}},
+            {tag = "soap:Body", {tag = "Order", attr = {id = "1"},
+                {tag = "Item", "x"}}}},
+        "only chosen paths"
+    )
+    test:is_deeply(
+        decode(xml, {only = {"Header"}, skip = {"Signature"}}),
+        {tag = "soap:Envelope",
+            {tag = "soap:Header", {tag = "Auth", attr = {user = "u"}}}},
+        "only and skip"
+    )
+    test:is_deeply(
+        decode(xml, {only = {"Body/Order/Item"}, attributes = false}),
+        {tag = "soap:Envelope", {tag = "soap:Body", {tag = "Order",
+            {tag = "Item", "x"}}}},
+        "no attributes"
+    )
+    test:is_deeply(
+        decode(xml, {only = {"Body"}, text = false}),
+        {tag = "soap:Envelope", {tag = "soap:Body",
+            {tag = "Order", attr = {id = "1"}, {tag = "Item"}},
+            {tag = "Attachment"}}},
+        "no text"
+    )
+    test:is_deeply(decode(xml, {only = {"Missing"}}), {tag = "soap:Envelope"},
+        "nothing matches")
+    test:is_deeply(
+        {decode(xml, {only = {"Body//Order"}})},
+        {nil, "xml decode: `only' option must be an array of paths"},
+        "invalid path"
+    )
+end)
+
+----------------------------
+test:diag("Test validation")
+
+test:test("validate", function(test)
+    test:plan(8)
+    local validate = luarapidxml.validate
+    test:is(validate('<?xml version="1.0"?><a x="&amp;">&#x41;<b/><![CDATA[&]]></a>'),
+        true, "well-formed document")
+    test:is_deeply({validate('<a></b>')},
+        {nil, "invalid xml string: invalid closing tag name", 6},
+        "mismatched closing tag")
+    test:is(validate('<a></b>', {validate_closing_tags = false}), true,
+        "closing tags are not checked")
+    test:is_deeply({validate('<a x="1 &bad; 2"/>')},
+        {nil, "xml validate: invalid escape sequence", 8},
+        "invalid escape in attribute")
+    test:is_deeply({validate('<a>&#x7FFFFFFF;</a>')},
+        {nil, "xml validate: invalid unicode codepoint", 3},
+        "invalid codepoint")
+    test:is_deeply({validate('<a/><b/>')},
+        {nil, "xml validate: more than one root element", 4},
+        "several roots")
+    test:is_deeply({validate('')},
+        {nil, "xml validate: no root element", 0},
+        "empty string")
+    test:is_deeply({validate('<a>')},
+        {nil, "invalid xml string: unexpected end of data", 3},
+        "unexpected end")
+end)
+
+-----------------------------
+test:diag("Test path lookup")
+
+test:test("get", function(test)
+    test:plan(11)
+    local get = luarapidxml.get
+    local xml = '<?xml version="1.0"?><!DOCTYPE e [<!ELEMENT e ANY>]>' ..
+        '<soap:Envelope xmlns:soap="urn:s"><soap:Header a=">"/>' ..
+        '<soap:Body><!-- <Fault> --><Item id="1"/><Item id="2" n=\'&lt;\'/>' ..
+        '<soap:Fault><faultcode>Server</faultcode>' ..
+        '<faultstring>Bad &amp; <![CDATA[<worse>]]><i>!</i></faultstring>' ..
+        '</soap:Fault></soap:Body></soap:Envelope>'
+
+    test:is(get(xml, "Envelope/Body/Fault/faultstring"), "Bad & <worse>",
+        "element text")
+    test:is(get(xml, "Envelope/Body/Fault/faultcode"), "Server", "prefixed names")
+    test:is(get(xml, "Envelope/Body/Item/@id"), "1", "first matching element")
+    test:is(get(xml, "Envelope/Body/Item/@n"), nil,
+        "attribute of the first matching element only")
+    test:is(get(xml, "Envelope/@xmlns:soap"), "urn:s", "root attribute")
+    test:is(get(xml, "Envelope/Header"), "", "empty element")
+    test:is(get(xml, "Envelope/Body/Missing"), nil, "missing element")
+    test:is(get('<a><b>1</b><c>2</c>', "a/b"), "1",
+        "scanning stops once the path is found")
+    test:is(get('<b><c>', "a/b"), nil, "scanning stops at another root")
+    test:is_deeply({get('<a><b>1</b><c>2</c>', "a/d")},
+        {nil, "xml get: unexpected end of data"}, "truncated document")
+    test:is_deeply({get(xml, "Envelope//Body")},
+        {nil, "xml get: invalid path"}, "invalid path")
+end)
+
+----------------------------
+test:diag("Test namespaces")
+
+test:test("namespaces", function(test)
+    test:plan(7)
+    local xml = '<soap:Envelope xmlns:soap="urn:s" xmlns="urn:d">' ..
+        '<soap:Body><Item xml:lang="en" soap:id="1"/>' ..
+        '<p:Item xmlns:p="urn:&amp;p" xmlns=""><Plain/></p:Item>' ..
+        '<soap:Item xmlns:soap="urn:d"/></soap:Body></soap:Envelope>'
+
+    local doc = luarapidxml.decode(xml, {namespaces = true})
+    local body = doc[1]
+    test:is_deeply({doc.tag, doc.ns, body.tag, body.ns}, {"Envelope", "urn:s", "Body", "urn:s"},
+        "prefixed elements")
+    test:is_deeply({body[1].tag, body[1].ns}, {"Item", "urn:d"}, "default namespace")
+    test:is_deeply(body[1].attr, {["xml:lang"] = "en", ["soap:id"] = "1"},
+        "attribute names are kept")
+    test:is_deeply({body[2].tag, body[2].ns, body[2][1].tag, body[2][1].ns},
+        {"Item", "urn:&p", "Plain", nil}, "undeclared default namespace")
+    test:is(body[3].ns, "urn:d", "redeclared prefix")
+    test:is_deeply(luarapidxml.decode(xml, {namespaces = true, strip_xmlns = true}).attr, nil,
+        "xmlns attributes stripped")
+    test:is_deeply({luarapidxml.decode('<a><p:b/></a>', {namespaces = true})},
+        {nil, "xml decode: undeclared namespace prefix: p"}, "undeclared prefix")
+end)
+
+------------------------
+test:diag("Test limits")
+
+test:test("limits", function(test)
+    test:plan(9)
+    local decode = luarapidxml.decode
+    local xml = '<a x="1" y="22"><b><c>text</c></b><b/></a>'
+    local function limit(opts)
+        return {decode(xml, opts)}
+    end
+
+    test:is_deeply(limit({max_bytes = 10}),
+        {nil, "xml decode: limit exceeded: max_bytes", "max_bytes"}, "max_bytes")
+    test:is_deeply(limit({max_depth = 2}),
+        {nil, "xml decode: limit exceeded: max_depth", "max_depth"}, "max_depth")
+    test:is_deeply(limit({max_nodes = 4}),
+        {nil, "xml decode: limit exceeded: max_nodes", "max_nodes"}, "max_nodes")
+    test:is_deeply(limit({max_attributes = 1}),
+        {nil, "xml decode: limit exceeded: max_attributes", "max_attributes"},
+        "max_attributes")
+    test:is_deeply(limit({max_string = 3}),
+        {nil, "xml decode: limit exceeded: max_string", "max_string"}, "max_string")
+    test:is_deeply(limit({max_bytes = #xml, max_depth = 3, max_nodes = 5,
+        max_attributes = 2, max_string = 4}), {decode(xml)}, "limits not exceeded")
+    test:is_deeply({decode('<a>' .. string.rep('<b/>', 5000) .. '</a>', {timeout = 1e-9})},
+        {nil, "xml decode: limit exceeded: timeout", "timeout"}, "timeout")
+    test:is_deeply(limit({max_depth = -1}),
+        {nil, "xml decode: `max_depth' option must be a non-negative number"},
+        "invalid limit")
+    test:is(decode('<a>' .. string.rep('&lt;&gt;', 10000) .. '</a>')[1],
+        string.rep('<>', 10000), "many entities in one value")
+end)
+
+--------------------------------
+test:diag("Test deep documents")
+
+test:test("deep documents", function(test)
+    test:plan(6)
+    local depth = 20000
+    local xml = string.rep('<a>', depth) .. 'x' .. string.rep('</a>', depth)
+    local function levels(node)
+        local n = 1
+        while type(node[1]) == 'table' do
+            node, n = node[1], n + 1
+        end
+        return n
+    end
+    local doc = luarapidxml.decode(xml)
+    test:is(levels(doc), depth, "decoded")
+    test:is(luarapidxml.encode(doc), xml, "encoded")
+    test:is(luarapidxml.validate(xml), true, "validated")
+    test:is_deeply({luarapidxml.decode(xml, {max_depth = depth - 1})},
+        {nil, "xml decode: limit exceeded: max_depth", "max_depth"}, "limited")
+
+    local cached = luarapidxml.new({decode_cache_size = 1024 * 1024})
+    cached.decode(xml)
+    local copy = cached.decode(xml)
+    test:is_deeply({levels(copy), cached.cache_stats().hits}, {depth, 1},
+        "copied from the cache")
+    local tmpl = luarapidxml.template(xml:gsub('x', '${x}', 1))
+    test:is(tmpl:render({x = 'y'}), (xml:gsub('x', 'y', 1)), "template")
+end)
+
+--------------------------
+test:diag("Test yielding")
+
+test:test("yield", function(test)
+    test:plan(7)
+    local fiber = require('fiber')
+    local xml = '<a>' .. string.rep('<b x="1">text</b>', 1000) .. '</a>'
+    local doc = luarapidxml.decode(xml)
+
+    -- times another fiber got to run during the call
+    local function ticks(fn, ...)
+        local count, stop = 0, false
+        fiber.new(function()
+            while not stop do
+                count = count + 1
+                fiber.sleep(0)
+            end
+        end)
+        local res = {fn(...)}
+        stop = true
+        return count, res
+    end
+
+    local count, res = ticks(luarapidxml.decode, xml, {yield = 100})
+    test:ok(count > 0, "decode yields")
+    test:is_deeply(res, {doc}, "decoded")
+    test:is(ticks(luarapidxml.decode, xml), 0, "no yields by default")
+    count, res = ticks(luarapidxml.encode, doc, {yield = 100})
+    test:ok(count > 0 and res[1] == luarapidxml.encode(doc), "encode yields")
+
+    local f = fiber.new(function()
+        local self = fiber.self()
+        fiber.new(function() self:cancel() end)
+        return luarapidxml.decode(xml, {yield = 100})
+    end)
+    f:set_joinable(true)
+    test:is_deeply({f:join()}, {true, nil, "xml decode: fiber is cancelled"}, "cancelled")
+
+    -- parse errors are raised in the fiber they belong to
+    f = fiber.new(luarapidxml.decode, xml:sub(1, -2), {yield = 100})
+    f:set_joinable(true)
+    res = {luarapidxml.decode(xml, {yield = 100})}
+    test:is_deeply({res, {f:join()}},
+        {{doc}, {true, nil, "invalid xml string: expected >"}}, "interleaved parse error")
+    test:is_deeply({luarapidxml.encode(doc, {yield = 0})},
+        {nil, "xml encode: `yield' option must be a boolean or a positive number"},
+        "invalid option")
+end)
+
+--------------------------
+test:diag("Test contexts")
+
+test:test("contexts", function(test)
+    test:plan(7)
+    local ctx = luarapidxml.new({
+        decode_cache_size = 1024 * 1024,
+        decode = {trim_whitespace = true},
+        encode = {estimate = true},
+    })
+    local doc = '<a> x </a>'
+    test:is_deeply({ctx.decode(doc), luarapidxml.decode(doc)},
+        {{tag = "a", "x"}, {tag = "a", " x "}}, "default options")
+    test:is(ctx.decode(doc, {trim_whitespace = false})[1], " x ", "options override defaults")
+    test:is_deeply({ctx.decode(doc), ctx.cache_stats().hits}, {{tag = "a", "x"}, 1},
+        "documents decoded with the defaults are cached")
+    test:is(ctx.cfg().decode_cache_size - luarapidxml.cfg().decode_cache_size,
+        1024 * 1024, "own settings")
+
+    local plain = luarapidxml.new({decode_cache_size = 1024 * 1024})
+    local hits = luarapidxml.cache_stats().hits
+    plain.decode(doc)
+    plain.decode(doc)
+    test:is_deeply({plain.cache_stats().hits, luarapidxml.cache_stats().hits},
+        {1, hits}, "own cache")
+
+    local tmpl = ctx.template('<a>${x}</a>')
+    ctx = nil
+    collectgarbage()
+    test:is(tmpl:render({x = 1}), '<a>1</a>', "objects keep the context")
+    test:ok(not pcall(luarapidxml.new, {decode = true}), "invalid options")
+end)
+
+----------------------------
+test:diag("Test statistics")
+
+test:test("stats", function(test)
+    test:plan(6)
+    local ctx = luarapidxml.new()
+    local stats = ctx.stats()
+    if stats == nil then
+        for _ = 1, 6 do
+            test:skip("statistics are disabled at build time")
+        end
+        return
+    end
+    test:is(stats.decode.calls, 0, "no calls yet")
+
+    local doc = '<a x="&amp;"><b>1</b><c/></a>'
+    ctx.decode(doc)
+    ctx.decode('<a>')
+    ctx.decode(doc, {max_depth = 1})
+    ctx.decode(doc, {yield = 0})
+    ctx.encode({tag = "a", "x"})
+    stats = ctx.stats()
+    test:is_deeply(
+        {stats.decode.calls, stats.decode.bytes, stats.decode.elements,
+            stats.decode.attributes, stats.decode.strings},
+        {4, #doc * 3 + 3, 3, 1, 2}, "decode counters")
+    test:is_deeply(stats.decode.errors,
+        {options = 1, invalid = 1, limit = 1, cancelled = 0}, "errors by class")
+    test:is_deeply({stats.encode.calls, stats.encode.bytes}, {1, 8}, "encode counters")
+
+    local parse = stats.latency.parse
+    local sum = 0
+    for _, n in ipairs(parse.buckets) do
+        sum = sum + n
+    end
+    test:is_deeply({parse.count, sum}, {1, 1}, "the first call is timed")
+
+    ctx.reset_stats()
+    test:is(ctx.stats().decode.calls, 0, "reset")
+end)
+
 -----------------------------------------
 test:diag("Test transcoding performance")
 